@@ -0,0 +1,382 @@
+/*
+ * Benchmark of the directory archive path over synthetic trees
+ *
+ * Generates trees of different shapes (many tiny files, a few huge ones,
+ * deep nesting) filled with text or incompressible data, and times the
+ * traversal, the reads and the full archive build of each separately.
+ * Reports files/s, MB/s in and out and the peak RSS as JSON, so that
+ * codec, parallelism and caching changes can be compared run against run.
+ *
+ * The files are evicted from the page cache before the read and the
+ * archive phases, unless --warm is given.
+ *
+ * Build with "scons bench", run bench/archive_bench -h for the options.
+ */
+
+// easytransfer.cpp is compiled into the benchmark as it is, minus its
+// main(), so that the archive code is the real one
+#define EASYTRANSFER_NO_MAIN
+#include "easytransfer.cpp"
+
+#include <sys/resource.h>
+
+// a tree shape: how many files of which size, how deeply nested
+struct tree_shape
+{
+    const char *name;
+    uintmax_t file_size;        // 0 to split the tree size over 4 files
+    unsigned int files_per_directory;
+    bool nested;                // every directory inside the previous one
+};
+
+const tree_shape shapes[] =
+{
+    { "tiny", 1024,             1000, false },
+    { "huge", 0,                4,    false },
+    { "deep", 64 * 1024,        4,    true },
+};
+
+struct tree_result
+{
+    std::string name;
+    uintmax_t files;
+    uintmax_t bytes;
+    double traversal;           // seconds
+    double read;
+    double archive;
+    uintmax_t archive_in;       // bytes read into the archive
+    uintmax_t archive_out;      // compressed bytes
+    double cache_hit;           // seconds for an up-to-date cached archive, or < 0
+    long peak_rss_kb;
+};
+
+double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// parses "4K", "10M", "10G" and plain byte counts
+uintmax_t parse_size(const std::string& str)
+{
+    char *end;
+    uintmax_t size = strtoull(str.c_str(), &end, 10);
+    switch (toupper(*end))
+    {
+    case 'G': size <<= 10;
+    case 'M': size <<= 10;
+    case 'K': size <<= 10;
+    }
+    return size;
+}
+
+// resets the peak RSS, so that each tree reports its own
+void reset_peak_rss()
+{
+    FILE *file = fopen("/proc/self/clear_refs", "w");
+    if (file)
+    {
+        fputs("5", file);
+        fclose(file);
+    }
+}
+
+long peak_rss_kb()
+{
+    long kb = -1;
+    char line[256];
+    FILE *file = fopen("/proc/self/status", "r");
+    while (file && fgets(line, sizeof(line), file))
+        if (sscanf(line, "VmHWM: %ld kB", &kb) == 1)
+            break;
+    if (file)
+        fclose(file);
+    if (kb < 0)
+    {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        kb = usage.ru_maxrss;
+    }
+    return kb;
+}
+
+// fills buffer with text-like data that compresses about as well as
+// source code, or with random bytes that don't compress at all
+void fill(std::vector<char>& buffer, size_t length, bool random, mt19937& generator)
+{
+    static const char *words[] =
+    {
+        "the ", "file ", "is ", "transferred ", "directly ", "from ", "your ",
+        "computer ", "to ", "other ", "person's ", "link ", "expires ", "after ",
+        "{\n", "}\n", "return ", "int ", "const ", "std::string ", "if (", ");\n",
+    };
+    const size_t num_words = sizeof(words) / sizeof(words[0]);
+    if (random)
+    {
+        for (size_t i = 0; i + 4 <= length; i += 4)
+        {
+            uint32_t r = generator();
+            memcpy(&buffer[i], &r, 4);
+        }
+        return;
+    }
+    for (size_t i = 0; i < length; )
+    {
+        const char *word = words[generator() % num_words];
+        for (; *word && i < length; ++word, ++i)
+            buffer[i] = *word;
+    }
+}
+
+void write_file(const path& p, uintmax_t size, bool random, mt19937& generator,
+                std::vector<char>& buffer)
+{
+    FILE *file = fopen(p.c_str(), "wb");
+    if (!file)
+    {
+        fprintf(stderr, "cannot create %s\n", p.c_str());
+        exit(EXIT_FAILURE);
+    }
+    while (size > 0)
+    {
+        size_t length = (size_t)std::min<uintmax_t>(size, buffer.size());
+        fill(buffer, length, random, generator);
+        fwrite(&buffer[0], 1, length, file);
+        size -= length;
+    }
+    fclose(file);
+}
+
+// creates the tree under root, tree_size bytes in total
+void generate_tree(const path& root, const tree_shape& shape, bool random,
+                   uintmax_t tree_size)
+{
+    mt19937 generator(42);
+    std::vector<char> buffer(1024 * 1024);
+    uintmax_t file_size = shape.file_size ? shape.file_size : tree_size / 4;
+    uintmax_t files = std::max<uintmax_t>(1, tree_size / file_size);
+
+    path directory = root;
+    for (uintmax_t i = 0; i < files; ++i)
+    {
+        if (i % shape.files_per_directory == 0)
+        {
+            std::string name = "d" + lexical_cast<std::string>(i / shape.files_per_directory);
+            directory = (shape.nested ? directory : root) / name;
+            create_directories(directory);
+        }
+        write_file(directory / ("f" + lexical_cast<std::string>(i)), file_size, random,
+                   generator, buffer);
+    }
+}
+
+// drops the tree from the page cache, so that the phases read from disk
+void evict_tree(const path& root)
+{
+    ::sync();
+    for (recursive_directory_iterator iter(root), end; iter != end; ++iter)
+    {
+        if (is_directory(iter->path()))
+            continue;
+#ifdef POSIX_FADV_DONTNEED
+        int fd = open(iter->path().c_str(), O_RDONLY);
+        if (fd >= 0)
+        {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            close(fd);
+        }
+#endif
+    }
+}
+
+// output function that throws the archive away
+struct null_output
+{
+    bool operator()(const void *, size_t) const
+    {
+        return true;
+    }
+};
+
+tree_result run_tree(const path& root, const std::string& name, bool warm, bool cache)
+{
+    tree_result result;
+    result.name = name;
+    result.files = result.bytes = 0;
+    reset_peak_rss();
+
+    // traversal, the walk write_directory() does
+    double start = now_seconds();
+    std::vector<walk_entry> entries = walk_directory(root, io_threads);
+    for (size_t i = 0; i < entries.size(); ++i)
+    {
+        if (entries[i].directory)
+            continue;
+        ++result.files;
+        result.bytes += entries[i].size;
+    }
+    result.traversal = now_seconds() - start;
+
+    // reads, in the same order and chunks as write_directory(), on one thread
+    if (!warm)
+        evict_tree(root);
+    std::vector<char> buffer(io_chunk_size);
+    start = now_seconds();
+    for (size_t i = 0; i < entries.size(); ++i)
+    {
+        if (entries[i].directory)
+            continue;
+        FILE *file = fopen(entries[i].file.c_str(), "rb");
+        if (!file)
+            continue;
+        setvbuf(file, NULL, _IONBF, 0);
+        while (fread(&buffer[0], 1, buffer.size(), file) == buffer.size())
+            ;
+        fclose(file);
+    }
+    result.read = now_seconds() - start;
+
+    // the whole archive, as it would be streamed
+    if (!warm)
+        evict_tree(root);
+    uintmax_t in_before, out_before, in_after, out_after;
+    size_t in_progress;
+    compression.get(in_before, out_before, in_progress);
+    start = now_seconds();
+    write_archive(root, null_output());
+    result.archive = now_seconds() - start;
+    compression.get(in_after, out_after, in_progress);
+    result.archive_in = in_after - in_before;
+    result.archive_out = out_after - out_before;
+
+    // a cached archive of an unchanged tree only costs the fingerprint
+    result.cache_hit = -1;
+    if (cache && archives.get(root))
+    {
+        start = now_seconds();
+        archives.get(root);
+        result.cache_hit = now_seconds() - start;
+        archives.clear();
+    }
+
+    result.peak_rss_kb = peak_rss_kb();
+    return result;
+}
+
+void print_json(uintmax_t tree_size, bool warm, const std::vector<tree_result>& results)
+{
+    printf("{\n  \"codec\": \"%s\",\n  \"threads\": %u,\n  \"io_threads\": %u,\n  \"io_chunk\": %u,\n"
+           "  \"tree_size\": %ju,\n  \"page_cache\": \"%s\",\n  \"results\": [",
+           codec->name, compress_threads, io_threads, (unsigned int)io_chunk_size, tree_size,
+           warm ? "warm" : "cold");
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const tree_result& r = results[i];
+        printf("%s\n    {\"tree\": \"%s\", \"files\": %ju, \"bytes\": %ju, "
+               "\"traversal_s\": %.3f, \"read_s\": %.3f, \"archive_s\": %.3f, "
+               "\"traversal_files_per_s\": %.0f, \"read_mb_per_s\": %.1f, "
+               "\"archive_files_per_s\": %.0f, \"archive_mb_per_s_in\": %.1f, "
+               "\"archive_mb_per_s_out\": %.1f, \"ratio\": %.3f, ",
+               i ? "," : "", r.name.c_str(), r.files, r.bytes,
+               r.traversal, r.read, r.archive,
+               r.files / r.traversal, r.bytes / 1e6 / r.read,
+               r.files / r.archive, r.archive_in / 1e6 / r.archive,
+               r.archive_out / 1e6 / r.archive,
+               r.archive_in ? (double)r.archive_out / r.archive_in : 0);
+        if (r.cache_hit >= 0)
+            printf("\"cache_hit_s\": %.6f, ", r.cache_hit);
+        printf("\"peak_rss_kb\": %ld}", r.peak_rss_kb);
+    }
+    printf("\n  ]\n}\n");
+}
+
+int main(int argc, char *argv[])
+{
+    options_description desc("Usage: archive_bench [options]\nAllowed options");
+    desc.add_options()
+        ("help,h", "produce help message")
+        ("size,s", value<std::string>()->default_value("256M"), "bytes per tree")
+        ("trees", value<std::string>()->default_value("tiny-text,tiny-random,huge-text,huge-random,deep-text,deep-random"),
+         "trees to generate, <shape>-<data> with shape tiny, huge or deep and data text or random")
+        ("codec", value<std::string>()->default_value("auto"), "auto, gzip, zstd, lz4 or store")
+        ("threads,j", value<unsigned int>()->default_value(thread::hardware_concurrency()),
+         "compression threads")
+        ("io-chunk", value<unsigned int>()->default_value(256), "size of file reads in KB")
+        ("io-threads", value<unsigned int>()->default_value(4), "threads walking the trees and reading ahead of the archiver")
+        ("warm", "leave the trees in the page cache")
+        ("cache", "also time a lookup of an up-to-date cached archive")
+        ("dir", value<std::string>(), "where to generate the trees, a temp directory by default");
+    variables_map vm;
+    try
+    {
+        store(parse_command_line(argc, argv, desc), vm);
+        notify(vm);
+    }
+    catch (std::exception& e)
+    {
+        fprintf(stderr, "%s\n", e.what());
+        return EXIT_FAILURE;
+    }
+    if (vm.count("help"))
+    {
+        std::cout << desc << "\n";
+        return EXIT_SUCCESS;
+    }
+
+    compress_threads = std::max(1u, vm["threads"].as<unsigned int>());
+    io_chunk_size = size_t(std::min(std::max(vm["io-chunk"].as<unsigned int>(), 8u), 65536u)) * 1024;
+    io_threads = std::min(std::max(vm["io-threads"].as<unsigned int>(), 1u), 64u);
+    std::string codec_name = vm["codec"].as<std::string>();
+    for (codec = codecs; codec != codecs + sizeof(codecs) / sizeof(codecs[0]); ++codec)
+        if (codec_name == codec->name)
+            break;
+    if (codec == codecs + sizeof(codecs) / sizeof(codecs[0]))
+    {
+        fprintf(stderr, "unknown codec: %s\n", codec_name.c_str());
+        return EXIT_FAILURE;
+    }
+
+    uintmax_t tree_size = parse_size(vm["size"].as<std::string>());
+    bool warm = vm.count("warm") > 0;
+    path directory = vm.count("dir") ? path(vm["dir"].as<std::string>()) :
+        temp_directory_path() / unique_path("archive-bench-%%%%%%%%");
+
+    std::vector<tree_result> results;
+    std::string trees = vm["trees"].as<std::string>();
+    for (size_t begin = 0; begin < trees.length(); )
+    {
+        size_t end = trees.find(',', begin);
+        if (end == std::string::npos)
+            end = trees.length();
+        std::string name = trees.substr(begin, end - begin);
+        begin = end + 1;
+
+        size_t dash = name.find('-');
+        std::string data = dash == std::string::npos ? "" : name.substr(dash + 1);
+        const tree_shape *shape = shapes;
+        while (shape != shapes + sizeof(shapes) / sizeof(shapes[0]) &&
+               name.compare(0, dash, shape->name) != 0)
+            ++shape;
+        if (shape == shapes + sizeof(shapes) / sizeof(shapes[0]) ||
+            (data != "text" && data != "random"))
+        {
+            fprintf(stderr, "unknown tree: %s\n", name.c_str());
+            return EXIT_FAILURE;
+        }
+
+        fprintf(stderr, "%s: generating...\n", name.c_str());
+        path root = directory / name;
+        remove_all(root);
+        create_directories(root);
+        generate_tree(root, *shape, data == "random", tree_size);
+        fprintf(stderr, "%s: archiving...\n", name.c_str());
+        results.push_back(run_tree(root, name, warm, vm.count("cache") > 0));
+        remove_all(root);
+    }
+
+    if (!vm.count("dir"))
+        remove_all(directory);
+    print_json(tree_size, warm, results);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,340 @@
+/*
+ * Loopback benchmark of the HTTP send path
+ *
+ * Starts mongoose in-process with the easytransfer callback, shares a file
+ * of each size, and downloads it with concurrent clients over loopback for
+ * a fixed time. Reports throughput, time to first byte and the CPU time the
+ * server spent per GB as JSON, so that changes to send_file_data() or to the
+ * threading can be compared run against run.
+ *
+ * The files are sparse, so this measures the send path with the page cache
+ * warm, not the disk.
+ *
+ * Build with "scons bench", run bench/http_bench -h for the options.
+ */
+
+// easytransfer.cpp is compiled into the benchmark as it is, minus its
+// main(), so that the callback and the share table are the real ones
+#define EASYTRANSFER_NO_MAIN
+#include "easytransfer.cpp"
+
+#include <sys/resource.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+
+// one size's worth of downloads
+struct bench_result
+{
+    uintmax_t size;
+    unsigned int requests;
+    unsigned int errors;
+    uintmax_t bytes;
+    double seconds;
+    double ttfb_p50;            // ms
+    double ttfb_p99;
+    double server_cpu;          // seconds, the clients' own time excluded
+    double total_cpu;
+};
+
+// what a client thread measured
+struct client_result
+{
+    std::vector<double> ttfb;   // ms, one per successful request
+    unsigned int errors;
+    uintmax_t bytes;
+    double cpu;                 // seconds of this thread
+};
+
+double now_seconds(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double process_cpu_seconds()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+        usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+// parses "4K", "10M", "10G" and plain byte counts
+uintmax_t parse_size(const std::string& str)
+{
+    char *end;
+    uintmax_t size = strtoull(str.c_str(), &end, 10);
+    switch (toupper(*end))
+    {
+    case 'G': size <<= 10;
+    case 'M': size <<= 10;
+    case 'K': size <<= 10;
+    }
+    return size;
+}
+
+// downloads uri once, returns the body size or -1 on error. ttfb is the
+// time from connecting to the first byte of the response.
+intmax_t download(unsigned short port, const std::string& uri, double& ttfb,
+                  std::vector<char>& buffer)
+{
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0)
+        return -1;
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    double start = now_seconds(CLOCK_MONOTONIC);
+    std::string request = "GET " + uri + " HTTP/1.1\r\nHost: 127.0.0.1\r\n"
+        "Connection: close\r\n\r\n";
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        send(sock, request.data(), request.length(), 0) != (ssize_t)request.length())
+    {
+        close(sock);
+        return -1;
+    }
+
+    // the body is whatever follows the headers until the server closes
+    intmax_t received = 0, body = -1;
+    std::string headers;
+    ssize_t n;
+    while ((n = recv(sock, &buffer[0], buffer.size(), 0)) > 0)
+    {
+        if (received == 0)
+            ttfb = (now_seconds(CLOCK_MONOTONIC) - start) * 1000;
+        received += n;
+        if (body < 0)
+        {
+            headers.append(&buffer[0], n);
+            size_t end = headers.find("\r\n\r\n");
+            if (end != std::string::npos)
+            {
+                if (headers.compare(0, 12, "HTTP/1.1 200") != 0)
+                    break;
+                body = headers.length() - end - 4;
+            }
+        }
+        else
+            body += n;
+    }
+    close(sock);
+    return n < 0 ? -1 : body;
+}
+
+void run_client(unsigned short port, const std::string& uri, uintmax_t size,
+                double deadline, client_result& result)
+{
+    double cpu_start = now_seconds(CLOCK_THREAD_CPUTIME_ID);
+    std::vector<char> buffer(256 * 1024);
+    result.errors = 0;
+    result.bytes = 0;
+
+    // at least one request, even if it outlasts the deadline
+    do
+    {
+        double ttfb = 0;
+        intmax_t body = download(port, uri, ttfb, buffer);
+        if (body != (intmax_t)size)
+            ++result.errors;
+        else
+        {
+            result.ttfb.push_back(ttfb);
+            result.bytes += body;
+        }
+    } while (now_seconds(CLOCK_MONOTONIC) < deadline);
+
+    result.cpu = now_seconds(CLOCK_THREAD_CPUTIME_ID) - cpu_start;
+}
+
+double percentile(std::vector<double>& samples, double p)
+{
+    if (samples.empty())
+        return 0;
+    std::sort(samples.begin(), samples.end());
+    size_t i = (size_t)(p * (samples.size() - 1) + 0.5);
+    return samples[i];
+}
+
+bench_result run_size(unsigned short port, const path& directory, uintmax_t size,
+                      unsigned int clients, double seconds)
+{
+    bench_result result;
+    memset(&result, 0, sizeof(result));
+    result.size = size;
+
+    // a sparse file of that size, shared for as long as the run takes
+    path file = directory / ("bench-" + lexical_cast<std::string>(size));
+    int fd = open(file.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0600);
+    if (fd < 0 || ftruncate(fd, size) != 0)
+    {
+        fprintf(stderr, "cannot create %s\n", file.c_str());
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    uint64_t uuid = shares.add(file, INT_MAX, 24 * 60 * 60);
+    std::string uri = '/' + lexical_cast<std::string>(uuid);
+
+    std::vector<client_result> client_results(clients);
+    thread_group group;
+    double cpu_start = process_cpu_seconds();
+    double start = now_seconds(CLOCK_MONOTONIC);
+    for (unsigned int i = 0; i < clients; ++i)
+        group.create_thread(bind(run_client, port, uri, size, start + seconds,
+                                 ref(client_results[i])));
+    group.join_all();
+    result.seconds = now_seconds(CLOCK_MONOTONIC) - start;
+
+    // offloaded sends may still be closing their sockets
+    mg_pool_stats stats;
+    for (mg_get_pool_stats(ctx, &stats); stats.num_transfers > 0; mg_get_pool_stats(ctx, &stats))
+        this_thread::sleep(posix_time::milliseconds(1));
+    result.total_cpu = process_cpu_seconds() - cpu_start;
+    result.server_cpu = result.total_cpu;
+
+    std::vector<double> ttfb;
+    for (unsigned int i = 0; i < clients; ++i)
+    {
+        ttfb.insert(ttfb.end(), client_results[i].ttfb.begin(), client_results[i].ttfb.end());
+        result.errors += client_results[i].errors;
+        result.bytes += client_results[i].bytes;
+        result.server_cpu -= client_results[i].cpu;
+    }
+    result.requests = ttfb.size() + result.errors;
+    result.ttfb_p50 = percentile(ttfb, 0.50);
+    result.ttfb_p99 = percentile(ttfb, 0.99);
+
+    shares.remove(uuid);
+    remove(file);
+    return result;
+}
+
+void print_json(const std::map<std::string, std::string>& options, unsigned int clients,
+                double seconds, const std::vector<bench_result>& results)
+{
+    printf("{\n  \"clients\": %u,\n  \"seconds_per_size\": %g,\n  \"options\": {", clients, seconds);
+    for (std::map<std::string, std::string>::const_iterator iter = options.begin();
+         iter != options.end(); ++iter)
+        printf("%s\n    \"%s\": \"%s\"", iter == options.begin() ? "" : ",",
+               iter->first.c_str(), iter->second.c_str());
+    printf("\n  },\n  \"results\": [");
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const bench_result& r = results[i];
+        double gb = r.bytes / 1e9;
+        printf("%s\n    {\"size\": %ju, \"requests\": %u, \"errors\": %u, \"bytes\": %ju, "
+               "\"seconds\": %.3f, \"mb_per_s\": %.1f, \"ttfb_p50_ms\": %.3f, "
+               "\"ttfb_p99_ms\": %.3f, \"server_cpu_s_per_gb\": %.3f, "
+               "\"total_cpu_s_per_gb\": %.3f}",
+               i ? "," : "", r.size, r.requests, r.errors, r.bytes, r.seconds,
+               r.bytes / 1e6 / r.seconds, r.ttfb_p50, r.ttfb_p99,
+               gb > 0 ? r.server_cpu / gb : 0, gb > 0 ? r.total_cpu / gb : 0);
+    }
+    printf("\n  ]\n}\n");
+}
+
+int main(int argc, char *argv[])
+{
+    options_description desc("Usage: http_bench [options]\nAllowed options");
+    desc.add_options()
+        ("help,h", "produce help message")
+        ("sizes,s", value<std::string>()->default_value("4K,64K,1M,16M,256M,1G"),
+         "file sizes to download, up to 10G and beyond")
+        ("clients,c", value<unsigned int>()->default_value(16), "concurrent clients")
+        ("seconds,t", value<double>()->default_value(3), "how long to download each size")
+        ("dir", value<std::string>(), "where to create the files, a temp directory by default")
+        ("option,o", value<std::vector<std::string> >(),
+         "mongoose option as name=value, e.g. -o enable_io_uring=yes");
+    variables_map vm;
+    try
+    {
+        store(parse_command_line(argc, argv, desc), vm);
+        notify(vm);
+    }
+    catch (std::exception& e)
+    {
+        fprintf(stderr, "%s\n", e.what());
+        return EXIT_FAILURE;
+    }
+    if (vm.count("help"))
+    {
+        std::cout << desc << "\n";
+        return EXIT_SUCCESS;
+    }
+
+    // the same settings the program runs with, unless overridden. the
+    // digest thread would count as server cpu, hashing isn't measured here
+    io_chunk_size = 256 * 1024;
+    compute_digests = false;
+    std::map<std::string, std::string> options;
+    options["enable_directory_listing"] = "no";
+    options["enable_epoll"] = "yes";
+    options["io_buffer_size"] = lexical_cast<std::string>(io_chunk_size);
+    if (vm.count("option"))
+    {
+        const std::vector<std::string>& list = vm["option"].as<std::vector<std::string> >();
+        for (size_t i = 0; i < list.size(); ++i)
+        {
+            size_t eq = list[i].find('=');
+            if (eq == std::string::npos)
+            {
+                fprintf(stderr, "bad option, expected name=value: %s\n", list[i].c_str());
+                return EXIT_FAILURE;
+            }
+            options[list[i].substr(0, eq)] = list[i].substr(eq + 1);
+        }
+    }
+
+    // listen on loopback, on the first free port
+    srand(time(NULL));
+    unsigned short bench_port = 0;
+    for (int i = 0; i < 10 && !ctx; ++i)
+    {
+        bench_port = 20000 + rand() % 40000;
+        options["listening_ports"] = "127.0.0.1:" + lexical_cast<std::string>(bench_port);
+        std::vector<const char*> list;
+        for (std::map<std::string, std::string>::const_iterator iter = options.begin();
+             iter != options.end(); ++iter)
+        {
+            list.push_back(iter->first.c_str());
+            list.push_back(iter->second.c_str());
+        }
+        list.push_back(NULL);
+        ctx = mg_start(callback, NULL, &list[0]);
+    }
+    if (!ctx)
+    {
+        fprintf(stderr, "failed to start the server\n");
+        return EXIT_FAILURE;
+    }
+    options.erase("listening_ports");
+
+    path directory = vm.count("dir") ? path(vm["dir"].as<std::string>()) :
+        temp_directory_path() / unique_path("http-bench-%%%%%%%%");
+    create_directories(directory);
+
+    std::vector<bench_result> results;
+    std::string sizes = vm["sizes"].as<std::string>();
+    unsigned int clients = std::max(1u, vm["clients"].as<unsigned int>());
+    double seconds = vm["seconds"].as<double>();
+    for (size_t begin = 0; begin < sizes.length(); )
+    {
+        size_t end = sizes.find(',', begin);
+        if (end == std::string::npos)
+            end = sizes.length();
+        uintmax_t size = parse_size(sizes.substr(begin, end - begin));
+        fprintf(stderr, "%ju bytes, %u clients...\n", size, clients);
+        results.push_back(run_size(bench_port, directory, size, clients, seconds));
+        begin = end + 1;
+    }
+
+    mg_stop(ctx);
+    if (!vm.count("dir"))
+        remove_all(directory);
+    print_json(options, clients, seconds, results);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,191 @@
+// Microbenchmark of the request parser
+//
+// Frames and parses realistic browser and curl requests on one thread
+// with every scanner the CPU supports, and prints the requests/s of each
+// as JSON. Before timing, it checks that all scanners agree with the
+// scalar one, on the sample requests and on random mutations of them.
+//
+// Build with "scons bench", run bench/parse_bench [seconds per run].
+
+// mongoose.c is compiled into the benchmark, so that the parser's static
+// functions can be called directly
+#include "mongoose.c"
+
+static const char *samples[][2] = {
+  {"curl",
+   "GET /6148914691236517205 HTTP/1.1\r\n"
+   "Host: 203.0.113.7:41234\r\n"
+   "User-Agent: curl/7.88.1\r\n"
+   "Accept: */*\r\n"
+   "\r\n"},
+  {"browser",
+   "GET /6148914691236517205 HTTP/1.1\r\n"
+   "Host: 203.0.113.7:41234\r\n"
+   "Connection: keep-alive\r\n"
+   "Upgrade-Insecure-Requests: 1\r\n"
+   "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+   "(KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+   "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+   "image/avif,image/webp,image/apng,*/*;q=0.8,"
+   "application/signed-exchange;v=b3;q=0.7\r\n"
+   "Referer: https://mail.example.com/mail/u/0/#inbox/FMfcgzGwHLt\r\n"
+   "Accept-Encoding: gzip, deflate\r\n"
+   "Accept-Language: en-US,en;q=0.9,de;q=0.8\r\n"
+   "Cookie: _ga=GA1.1.1234567890.1700000000; "
+   "session=4f9d2c1b8e7a6d5c4b3a29180f7e6d5c\r\n"
+   "\r\n"},
+};
+
+// Requests that are only checked, not timed
+static const char *edge_cases[] = {
+  // HTAB is allowed in header values
+  "GET / HTTP/1.1\r\nHost: a\r\nX-A: b\tc\r\n\r\n",
+  "GET / HTTP/1.1\r\nHost:\ta\r\n\r\n",
+  // Other control characters only matter when the request doesn't end
+  "GET / HTTP/1.1\r\nX-A: \x01\r\n\r\n",
+  "GET / HTTP/1.1\r\nX-A: \x7f\r\n",
+  "GET / HTTP/1.1\r\nX-A: b\tc\r\n",
+};
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The request framing rules of the original byte loop, with HTAB allowed
+static int reference_request_len(const char *buf, int buflen) {
+  const char *s, *e;
+  int len = 0;
+
+  for (s = buf, e = s + buflen - 1; len <= 0 && s < e; s++)
+    if (!isprint(* (const unsigned char *) s) && *s != '\r' &&
+        *s != '\n' && *s != '\t' && * (const unsigned char *) s < 128) {
+      len = -1;
+    } else if (s[0] == '\n' && s[1] == '\n') {
+      len = (int) (s - buf) + 2;
+    } else if (s[0] == '\n' && &s[1] < e &&
+        s[1] == '\r' && s[2] == '\n') {
+      len = (int) (s - buf) + 3;
+    }
+
+  return len;
+}
+
+// Frame and parse req as the worker does. Return a checksum of the result.
+static unsigned long parse(const char *req, int len, char *buf) {
+  struct mg_request_info ri;
+  unsigned char slots[NUM_KNOWN_HEADERS];
+  unsigned long sum;
+  int i, request_len;
+
+  memcpy(buf, req, len);
+  request_len = get_request_len(buf, len);
+  sum = (unsigned long) request_len;
+  if (request_len > 0) {
+    buf[request_len - 1] = '\0';
+    memset(&ri, 0, sizeof(ri));
+    memset(slots, 0, sizeof(slots));
+    if (parse_http_request(buf, &ri, slots)) {
+      sum = sum * 31 + (unsigned long) (ri.uri - buf) +
+        (unsigned long) (ri.http_version - buf);
+      for (i = 0; i < ri.num_headers; i++) {
+        sum = sum * 31 + (unsigned long) (ri.http_headers[i].name - buf);
+        sum = sum * 31 + (unsigned long) (ri.http_headers[i].value - buf);
+      }
+      for (i = 0; i < NUM_KNOWN_HEADERS; i++) {
+        sum = sum * 31 + slots[i];
+      }
+    }
+  }
+  return sum;
+}
+
+// Check that every scanner frames req like the reference, and parses it
+// like the scalar one. Return the number of mismatches.
+static int check_request(const char *req, int len, int num_scanners,
+                         char *buf) {
+  unsigned long expected;
+  int j, mismatches = 0;
+
+  memcpy(buf, req, len);
+  scanner = &scanners[0];
+  expected = parse(req, len, buf);
+  for (j = 0; j < num_scanners; j++) {
+    scanner = &scanners[j];
+    memcpy(buf, req, len);
+    if (get_request_len(buf, len) != reference_request_len(buf, len) ||
+        parse(req, len, buf) != expected) {
+      mismatches++;
+    }
+  }
+  return mismatches;
+}
+
+// Check the edge cases and random mutations of the samples with each
+// scanner. Return the number of mismatches.
+static int check_scanners(int num_scanners, char *buf) {
+  char req[1024];
+  const char *chars = "\r\n :\t\x7f\x01\x80\"aZ";
+  int i, k, len, mismatches = 0;
+
+  for (i = 0; i < (int) ARRAY_SIZE(edge_cases); i++) {
+    mismatches += check_request(edge_cases[i], (int) strlen(edge_cases[i]),
+                                num_scanners, buf);
+  }
+
+  srand(1);
+  for (i = 0; i < 100000; i++) {
+    len = (int) strlen(samples[i % ARRAY_SIZE(samples)][1]);
+    memcpy(req, samples[i % ARRAY_SIZE(samples)][1], len);
+    for (k = i % 4; k > 0 && i > 0; k--) {
+      req[rand() % len] = chars[rand() % strlen(chars)];
+    }
+    if (i % 3 == 1) {
+      len = rand() % len + 1;  // Incomplete request
+    }
+
+    mismatches += check_request(req, len, num_scanners, buf);
+  }
+  return mismatches;
+}
+
+int main(int argc, char *argv[]) {
+  double seconds = argc > 1 ? atof(argv[1]) : 1, start, elapsed;
+  const struct scanner *best;
+  unsigned long sum = 0;
+  long n;
+  int i, j, k, len, num_scanners, mismatches;
+  char *buf;
+
+  // Same buffer as a worker's, the kernels read whole aligned blocks
+  buf = (char *) malloc(16384);
+  select_scanner();
+  best = scanner;
+  num_scanners = (int) (best - scanners) + 1;
+  mismatches = check_scanners(num_scanners, buf);
+
+  printf("{\n  \"mismatches\": %d,\n  \"results\": [", mismatches);
+  for (i = 0; i < (int) ARRAY_SIZE(samples); i++) {
+    len = (int) strlen(samples[i][1]);
+    for (j = 0; j < num_scanners; j++) {
+      scanner = &scanners[j];
+      start = now();
+      n = 0;
+      do {
+        for (k = 0; k < 1000; k++) {
+          sum += parse(samples[i][1], len, buf);
+        }
+        n += 1000;
+      } while ((elapsed = now() - start) < seconds);
+      printf("%s\n    {\"request\": \"%s\", \"bytes\": %d, \"scanner\": \"%s\", "
+             "\"requests_per_s\": %.0f, \"ns_per_request\": %.1f}",
+             i == 0 && j == 0 ? "" : ",", samples[i][0], len, scanner->name,
+             n / elapsed, elapsed * 1e9 / n);
+    }
+  }
+  printf("\n  ],\n  \"checksum\": %lu\n}\n", sum);
+
+  free(buf);
+  return mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
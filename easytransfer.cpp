@@ -31,23 +31,42 @@
 #include <stdint.h>
 #include <assert.h>
 #include <signal.h>
+#include <math.h>
 #include <string>
 #include <map>
+#include <deque>
+#include <queue>
+#include <vector>
+#include <algorithm>
 #ifndef _WIN32
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
-//#include <netinet/in.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include <netdb.h>
 #endif
 #include <boost/filesystem.hpp>
 #include <boost/random.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/program_options.hpp>
+#include <boost/thread.hpp>
+#include <boost/function.hpp>
+#include <boost/bind/bind.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/unordered_map.hpp>
 #include <miniupnpc/miniupnpc.h>
 #include <miniupnpc/upnpcommands.h>
 #include <archive.h>
 #include <archive_entry.h>
+#include <zlib.h>
 #include "mongoose.h"
+#include "sha256.h"
 using namespace boost;
 using namespace boost::filesystem;
 using namespace boost::random;
@@ -79,16 +98,54 @@ uniform_smallint<uint16_t> port_gen(5000, 65535);
 
 mg_context *ctx = NULL;         // the server instance
 std::string port;               // the port
+std::string link_prefix;        // "http://<external ip>:<port>/", under link_lock
+mutex link_lock;
+path control_path;              // unix socket of the daemon's control API, empty if none
+const unsigned int ip_lookup_deadline = 10000;  // ms before giving up on the external ip
+const unsigned int network_check_deadline = 2000;   // ms to validate the cached network_info
+
+// what was found out about the network, cached across runs because the
+// router and the address rarely change
+struct network_info
+{
+    std::string control_url;    // of the IGD
+    std::string service_type;
+    std::string lan_address;    // ours, as the IGD sees it
+    std::string wan_address;    // the IGD's, it tells whether we moved
+    std::string external_ip;    // ours, as the internet sees it
+};
+network_info network;           // what this run found out, under network_lock
+mutex network_lock;
+unsigned int network_ttl;       // seconds the cache stays valid, 0 disables it
 bool use_upnp = false;          // whether we used UPnP to forward ports
 UPNPUrls urls;                  // UPnP variables
 IGDdatas data;
 
-path the_path;                  // path of the file
-uint64_t the_uuid;              // uuid of the resource
-int count;                      // how many downloads before expiration
-time_t expiration_time;         // the time at which it expires
+bool stream_archives = false;   // stream directories instead of using a temp file
+unsigned int compress_threads;  // threads compressing directories
+size_t io_chunk_size;           // size of the reads from shared files
+unsigned int io_threads = 4;    // threads walking directories and reading ahead of the archiver
+bool compute_digests = true;    // sha-256 of the shares, for Repr-Digest and /<uuid>.sha256
+
+// archive codecs selectable with --codec
+struct codec_info
+{
+    const char *name;
+    const char *extension;      // of the archive file
+    const char *mime_type;
+};
+const codec_info codecs[] =
+{
+    { "auto",  ".tgz",     "application/x-tar-gz" }, // gzip, incompressible data stored
+    { "gzip",  ".tgz",     "application/x-tar-gz" },
+    { "zstd",  ".tar.zst", "application/zstd" },
+    { "lz4",   ".tar.lz4", "application/x-lz4" },
+    { "store", ".tar",     "application/x-tar" },
+};
+const codec_info *codec = &codecs[0];   // codec used for directories
 
-bool quit = false;
+// destination of compressed data, returns false if it can't take more
+typedef function<bool (const void*, size_t)> output_fn;
 
 
 // functions for logging
@@ -148,15 +205,18 @@ std::string get_external_ip()
     int status = getaddrinfo("automation.whatismyip.com", "http", &hints, &servinfo);
     if (status != 0) return "";
 
-    // create the socket
+    // create the socket, and don't let a dead server hold up the lookup
     int sock;
+    struct timeval timeout = { 5, 0 };
     const char *query = "GET /n09230945.asp HTTP/1.1\r\n"
         "Host: automation.whatismyip.com\r\n"
         "User-Agent: Mozilla/5.0 (Windows NT 6.1; WOW64; rv:12.0) Gecko/20100101 Firefox/12.0\r\n\r\n";
     for (p = servinfo; p != NULL; p = p->ai_next)
     {
         sock = socket(AF_INET, SOCK_STREAM, 0);
-        if (socket < 0) continue;
+        if (sock < 0) continue;
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout, sizeof(timeout));
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (const char *)&timeout, sizeof(timeout));
 
         if (connect(sock, p->ai_addr, p->ai_addrlen) == -1)
         {
@@ -166,7 +226,9 @@ std::string get_external_ip()
 
         break;
     }
-    if (p == NULL) return "";
+    bool connected = p != NULL;
+    freeaddrinfo(servinfo);
+    if (!connected) return "";
 
     // send http request
     if (send(sock, query, strlen(query), 0) < 0)
@@ -192,6 +254,159 @@ std::string get_external_ip()
 }
 
 
+// network_info cache file
+path network_cache_path()
+{
+#ifdef _WIN32
+    return temp_directory_path() / "easytransfer-network";
+#else
+    const char *cache_home = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    if (cache_home && *cache_home)
+        return path(cache_home) / "easytransfer" / "network";
+    if (home && *home)
+        return path(home) / ".cache" / "easytransfer" / "network";
+    return temp_directory_path() / ("easytransfer-network-" + lexical_cast<std::string>(getuid()));
+#endif
+}
+
+// read the cache, fails if it's incomplete or older than network_ttl
+bool load_network_cache(network_info& info)
+{
+    if (network_ttl == 0)
+        return false;
+    FILE *file = FOPEN(network_cache_path().c_str(), T("r"));
+    if (!file)
+        return false;
+
+    long saved = 0;
+    char line[512];
+    while (fgets(line, sizeof(line), file))
+    {
+        std::string l(line);
+        size_t eq = l.find('=');
+        if (eq == std::string::npos)
+            continue;
+        std::string key = l.substr(0, eq);
+        std::string value = l.substr(eq + 1, l.find_last_not_of("\r\n") - eq);
+        if (key == "time")
+            saved = atol(value.c_str());
+        else if (key == "control_url")
+            info.control_url = value;
+        else if (key == "service_type")
+            info.service_type = value;
+        else if (key == "lan_address")
+            info.lan_address = value;
+        else if (key == "wan_address")
+            info.wan_address = value;
+        else if (key == "external_ip")
+            info.external_ip = value;
+    }
+    fclose(file);
+
+    return time(NULL) - saved < (long)network_ttl &&
+        info.control_url.length() && info.service_type.length() &&
+        info.wan_address.length() && info.external_ip.length();
+}
+
+// write what this run found out, once it's complete
+void save_network_cache()
+{
+    network_info info;
+    {
+        lock_guard<mutex> guard(network_lock);
+        info = network;
+    }
+    if (network_ttl == 0 || !info.control_url.length() || !info.external_ip.length())
+        return;
+
+    boost::system::error_code ec;
+    path cache = network_cache_path();
+    path temp = cache;
+    temp += ".tmp";
+    create_directories(cache.parent_path(), ec);
+    FILE *file = FOPEN(temp.c_str(), T("w"));
+    if (!file)
+        return;
+    fprintf(file, "time=%ld\ncontrol_url=%s\nservice_type=%s\nlan_address=%s\n"
+            "wan_address=%s\nexternal_ip=%s\n",
+            (long)time(NULL), info.control_url.c_str(), info.service_type.c_str(),
+            info.lan_address.c_str(), info.wan_address.c_str(), info.external_ip.c_str());
+    if (fclose(file) == 0)
+        rename(temp, cache, ec);
+    else
+        remove(temp, ec);
+}
+
+#ifndef _WIN32
+// our address on the route to the host of url, that is what the IGD
+// there has to forward to
+std::string local_address_for(const std::string& url)
+{
+    size_t begin = url.find("://");
+    begin = begin == std::string::npos ? 0 : begin + 3;
+    std::string host = url.substr(begin, url.find('/', begin) - begin);
+    std::string service = "80";
+    size_t colon = host.find(':');
+    if (colon != std::string::npos)
+    {
+        service = host.substr(colon + 1);
+        host.erase(colon);
+    }
+
+    struct addrinfo hints, *servinfo;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    if (getaddrinfo(host.c_str(), service.c_str(), &hints, &servinfo) != 0)
+        return "";
+
+    // connecting a UDP socket sends nothing, it only picks the route
+    std::string address;
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in local;
+    socklen_t len = sizeof(local);
+    if (sock >= 0 && connect(sock, servinfo->ai_addr, servinfo->ai_addrlen) == 0 &&
+        getsockname(sock, (struct sockaddr *)&local, &len) == 0)
+        address = inet_ntoa(local.sin_addr);
+    if (sock >= 0)
+        close(sock);
+    freeaddrinfo(servinfo);
+    return address;
+}
+#endif
+
+// check the cached network_info with the IGD: if it still answers with
+// the same WAN address, we're on the same network and can skip both the
+// discovery and the external ip lookup. returns an empty control_url if
+// the cache can't be used.
+network_info check_network_cache()
+{
+    network_info info;
+    char wan_address[40];
+    if (!load_network_cache(info) ||
+        UPNP_GetExternalIPAddress(info.control_url.c_str(), info.service_type.c_str(),
+                                  wan_address) != UPNPCOMMAND_SUCCESS ||
+        info.wan_address != wan_address)
+    {
+        log_printf("network cache miss\n");
+        return network_info();
+    }
+
+    // the address may have changed even if the network didn't
+#ifndef _WIN32
+    std::string lan_address = local_address_for(info.control_url);
+    if (lan_address.length())
+        info.lan_address = lan_address;
+#endif
+    log_printf("network cache hit: IGD %s, external ip %s\n",
+               info.control_url.c_str(), info.external_ip.c_str());
+    return info;
+}
+
+
+bool add_port_mapping(const char *lanaddr);
+
 // UPnP discovery
 bool upnp_discovery()
 {
@@ -225,41 +440,52 @@ bool upnp_discovery()
                    more_info, urls.controlURL);
     }
     log_printf("Local LAN ip address: %s\n", lanaddr);
+    freeUPNPDevlist(devlist);
+
+    // remember the IGD for the next run
+    char wan_address[40];
+    if (UPNP_GetExternalIPAddress(urls.controlURL, data.first.servicetype,
+                                  wan_address) == UPNPCOMMAND_SUCCESS)
+    {
+        lock_guard<mutex> guard(network_lock);
+        network.control_url = urls.controlURL;
+        network.service_type = data.first.servicetype;
+        network.lan_address = lanaddr;
+        network.wan_address = wan_address;
+    }
+    save_network_cache();
+
+    return add_port_mapping(lanaddr);
+}
 
+// forward the port from the IGD in urls/data to lanaddr
+bool add_port_mapping(const char *lanaddr)
+{
     // see if the external port is already mapped
     char intClient[40];
     char intPort[6];
     char duration[16];
-    bool has_mapping = false;
-    for (;;)
+    int r = UPNP_GetSpecificPortMappingEntry(
+        urls.controlURL,
+        data.first.servicetype,
+        port.c_str(),
+        "TCP",
+        intClient, intPort, NULL, NULL, duration);
+    if (r == UPNPCOMMAND_SUCCESS)
     {
-        int r = UPNP_GetSpecificPortMappingEntry(
-            urls.controlURL,
-            data.first.servicetype,
-            port.c_str(),
-            "TCP",
-            intClient, intPort, NULL, NULL, duration);
-
-        if (r != UPNPCOMMAND_SUCCESS)
-            break;
         if (!strcmp(intClient, lanaddr)) // great if it's mapped to us
         {
-            has_mapping = true;
-            break;
+            log_printf("mapping already exists for port %s\n", port.c_str());
+            return true;
         }
 
+        // the link is out already, so the port can't change anymore
         log_printf("external port %s already taken.\n", port.c_str());
-        port = lexical_cast<std::string>(port_gen(rng));
-    }
-
-    if (has_mapping)
-    {
-        log_printf("mapping already exists for port %s\n", port.c_str());
-        return true;
+        return false;
     }
 
     // try to add the port mapping
-    int r = UPNP_AddPortMapping(
+    r = UPNP_AddPortMapping(
         urls.controlURL,
         data.first.servicetype,
         port.c_str(),
@@ -279,6 +505,106 @@ bool upnp_discovery()
     return true;
 }
 
+
+// milliseconds since start, for the startup timings in verbose mode
+long elapsed_ms(const posix_time::ptime& start)
+{
+    return (posix_time::microsec_clock::universal_time() - start).total_milliseconds();
+}
+
+// runs a step of the startup on its own thread, so that the slow ones
+// overlap. wait() gives up on it after a deadline, and the thread is left
+// to finish on its own.
+template <typename Result>
+class startup_phase
+{
+public:
+    startup_phase(const char *name, const function<Result ()>& work)
+        : state(new shared_state)
+    {
+        state->name = name;
+        state->done = false;
+        state->start = posix_time::microsec_clock::universal_time();
+        thread(run, state, work).detach();
+    }
+
+    // returns false if the phase isn't done within deadline_ms of its start
+    bool wait(unsigned int deadline_ms, Result& result)
+    {
+        posix_time::ptime deadline = state->start + posix_time::milliseconds(deadline_ms);
+        unique_lock<mutex> guard(state->lock);
+        while (!state->done && state->finished.timed_wait(guard, deadline))
+            ;
+        if (!state->done)
+        {
+            log_printf("%s: gave up after %u ms\n", state->name, deadline_ms);
+            return false;
+        }
+        result = state->result;
+        return true;
+    }
+
+private:
+    struct shared_state
+    {
+        const char *name;
+        posix_time::ptime start;
+        Result result;
+        bool done;
+        mutex lock;
+        condition_variable finished;
+    };
+
+    static void run(shared_ptr<shared_state> state, function<Result ()> work)
+    {
+        Result result = work();
+        log_printf("%s: %ld ms\n", state->name, elapsed_ms(state->start));
+        lock_guard<mutex> guard(state->lock);
+        state->result = result;
+        state->done = true;
+        state->finished.notify_all();
+    }
+
+    shared_ptr<shared_state> state;
+};
+
+// maps the port in the background while the daemon is already serving.
+// a valid cache has the IGD already, only the mapping itself is left.
+bool map_port(startup_phase<network_info> cache_check)
+{
+    network_info cached;
+    if (cache_check.wait(network_check_deadline, cached) && cached.control_url.length())
+    {
+        {
+            lock_guard<mutex> guard(network_lock);
+            network = cached;
+        }
+        urls.controlURL = strdup(cached.control_url.c_str());
+        strncpy(data.first.servicetype, cached.service_type.c_str(),
+                sizeof(data.first.servicetype) - 1);
+        use_upnp = add_port_mapping(cached.lan_address.c_str());
+    }
+    else
+        use_upnp = upnp_discovery();
+    return use_upnp;
+}
+
+// the external ip, from the cache if it's still valid
+std::string lookup_external_ip(startup_phase<network_info> cache_check)
+{
+    network_info cached;
+    if (cache_check.wait(network_check_deadline, cached) && cached.control_url.length())
+        return cached.external_ip;
+
+    std::string external_ip = get_external_ip();
+    {
+        lock_guard<mutex> guard(network_lock);
+        network.external_ip = external_ip;
+    }
+    save_network_cache();
+    return external_ip;
+}
+
 // removes a UPnP mapping
 void remove_upnp_mapping()
 {
@@ -291,259 +617,2434 @@ void remove_upnp_mapping()
         log_printf("deleted port mapping.\n");
 }
 
-static void sig_hand(int code)
+// sha-256 of a file's content, as the file was when it was hashed
+struct content_digest
 {
-    log_printf("quitting...\n");
-    mg_stop(ctx);
-    if (use_upnp)
-        remove_upnp_mapping();
-    exit(EXIT_SUCCESS);
-}
+    unsigned char sha256[SHA256_DIGEST_SIZE];
+    uintmax_t size;
+    time_t mtime;
+    bool known;                 // the rest is set
 
+    content_digest() : size(0), mtime(0), known(false) {}
 
-// compress and entire directory
-// assumes that directory_path is valid
-void compress_directory(const path& directory_path,
-                        const path& outname)
+    std::string hex() const;
+    std::string base64() const;
+
+    // whether p is still the file that was hashed
+    bool matches(const path& p) const;
+};
+
+// the digest of a shared file, see digest_queue
+struct digest_job
+{
+    path file;
+    bool queued;                // waiting for the digest thread, or being hashed
+    content_digest digest;
+};
+
+// computes the digests of shared files on a background thread, one at a
+// time in the order they were shared. directories are not queued: their
+// archive is hashed as it's written, see archive_cache.
+class digest_queue
 {
-    log_printf("compressing directory \"%s\" into \"%s\"\n",
-               directory_path.c_str(), outname.c_str());
+public:
+    typedef shared_ptr<digest_job> handle;
 
-    // declare and initialize variables
-    struct archive *a = archive_write_new();
-    archive_write_set_compression_gzip(a);
-    archive_write_set_format_pax_restricted(a);
-    archive_write_open_filename(a, to_utf8(outname.c_str()));
-    struct archive_entry *entry = archive_entry_new();
-    
-    // offset of the parent directory's full path
-	int len = (directory_path.parent_path().native().length() + 1);
+    digest_queue() : stopping(false) {}
+    ~digest_queue();
 
-    recursive_directory_iterator end;
-    recursive_directory_iterator iter(directory_path);
-    while (iter != end)
-    {
-        const path& p = iter->path();
+    // hash the file p in the background
+    handle add(const path& p);
 
-        // ignore directories
-        if (is_directory(p))
-        {
-            ++iter;
-            continue;
-        }
-        
-        // set headers
-        archive_entry_set_pathname(entry, to_utf8(p.c_str()) + len); // add the offset to get rid of the absolute path
-        archive_entry_set_size(entry, file_size(p));
-        archive_entry_set_filetype(entry, AE_IFREG);
-        archive_entry_set_perm(entry, 0644);
-        archive_write_header(a, entry);
+    // the digest of the file as it is now. false if it isn't known yet, or
+    // if the file has changed since it was hashed
+    bool get(const handle& job, content_digest& digest);
 
-        // open the file for reading
-        FILE *file = FOPEN(p.c_str(), T("rb"));
-        if (!file)
-        {
-            log_printf("failed to open file for compression: %s\n", p.c_str());
-            continue;
-        }
+    // the file is about to be sent in full: hash it next, so that its
+    // digest is ready soon after the download, unless it is current already.
+    // the digest thread reads the file on its own, the sends never bring
+    // the data into user space
+    void hurry(const handle& job);
 
-        char buffer[8192];
-        int len;
-        do
-        {
-            len = fread(buffer, 1, sizeof(buffer), file);
-            archive_write_data(a, buffer, len);
-        } while (len == sizeof(buffer));
-        fclose(file);
-        archive_entry_clear(entry);
-        
-        ++iter;
-    }
+private:
+    void run();
+    bool hash_file(const path& p, content_digest& digest);
 
-    archive_write_close(a);
-    archive_write_finish(a);
-}
+    std::deque<handle> pending;
+    mutex lock;                 // for pending, stopping and the jobs
+    condition_variable wakeup;
+    scoped_ptr<thread> worker;  // started with the first job
+    bool stopping;
+};
 
+digest_queue digests;
 
-// handle GET requests
-void handle_get(mg_connection *conn,
-                const mg_request_info *request)
+// a shared file or directory, reachable at /<uuid> until it expires or
+// runs out of downloads
+struct share
 {
-    std::string response_status;
-    uint64_t uuid = 0;
-    try
-    {
-        uuid = isdigit(request->uri[1])? lexical_cast<uint64_t>(request->uri + 1) : 0;
-    }
-    catch (bad_lexical_cast ex)
-    { }
-    log_printf("uuid requested: %s\n", request->uri + 1);
+    path shared_path;
+    uint64_t uuid;
+    int downloads_left;         // how many downloads before expiration
+    time_t expiration_time;     // the time at which it expires
+    shared_ptr<mg_file_headers> headers;    // prepared once for a file, NULL for a directory
+    digest_queue::handle digest;            // of a file, NULL for a directory
+};
+
+// all shares of the daemon, keyed by uuid. the table is split into shards
+// with a lock each, so lookups from concurrent downloads rarely contend.
+// expiration times are kept in a min-heap, so that the daemon sleeps until
+// the next one is due, or until a share is gone for another reason.
+class share_table
+{
+public:
+    typedef shared_ptr<const share> share_ptr;
 
-    // make sure the uuid exists
-    if (uuid != the_uuid)
-    {
-        log_printf("uuid not correct\n");
-        response_status = "404 Not Found";
-    }
-    else
-    {
-        path& p = the_path;
-        
-        // check to see if the path is still valid
-        response_status = check_path(p);
-        if (response_status.length())
-            quit = true;
-        else
-        {
-            // if it's a directory, compress it
-            if (is_directory(p))
-            {
-                path::string_type filename = p.filename().native();
-                if (filename[0] == '.')
-                    filename.erase(0, 1);
-                path new_path = temp_directory_path() / filename;
-
-                new_path.replace_extension(".tgz");
-                compress_directory(p, new_path);
-                p = new_path;
-            }
+    share_table() : generator(time(NULL)), closed(false), changed(true), downloads(0), quitting(false) {}
 
-            // send the file
-            mg_send_file(conn, to_utf8(p.c_str()), to_utf8(p.filename().c_str()));
-            log_printf("finished sending the file.\n");
-            if (--count == 0)
-                quit = true;
-            return;
-        }
-    }
+    // share p for count downloads or duration seconds, returns the uuid,
+    // or 0 if the table has been closed
+    uint64_t add(const path& p, int count, unsigned int duration);
 
-    log_printf("responded with %s\n", response_status.c_str());
-    mg_printf(conn, "HTTP/1.1 %s\r\n"
-              "Content-Type: text/plain\r\n\r\n",
-              response_status.c_str());
-}
+    // claim a download of the share. returns NULL if there's no such share,
+    // or if it has expired or run out of downloads. the download lasts as
+    // long as the returned pointer.
+    share_ptr acquire(uint64_t uuid);
 
+    // copy of a share that hasn't expired, without claiming a download
+    bool find(uint64_t uuid, share& result);
 
-// HTTP callback
-void *callback(mg_event event,
-               mg_connection *conn,
-               const mg_request_info *request)
-{
-    if (event != MG_NEW_REQUEST)
-        return (void*)1;
+    bool remove(uint64_t uuid);
 
-    log_printf("new request: =====================\n"
-               "method: %s\n"
-               "uri: %s\n"
-               "ip: %lx\n",
-               request->request_method,
-               request->uri,
-               request->remote_ip);
-    for (int i = 0; i < request->num_headers; ++i)
-        log_printf("%s - %s\n", request->http_headers[i]);
+    // change the download budget and/or the expiration time of a share,
+    // a negative value leaves it as it is
+    bool update(uint64_t uuid, int count, long duration);
 
-    if (!strcmp(request->request_method, "GET"))
-        handle_get(conn, request);
+    // copy of every share
+    std::vector<share> list();
 
-    putchar('\n');
+    // expire the shares as they're due, and return true once there are
+    // none left and the table is closed, or false if quit() was called
+    bool wait_until_empty();
 
-//    if (quit)
-//        raise(SIGTERM);
+    // wait for the downloads acquired so far to finish, returns false if
+    // quit() was called
+    bool wait_for_downloads();
 
-    return (void*)1;
-}
+    // make the waits above return false, to shut down early
+    void quit();
 
+private:
+    typedef unordered_map<uint64_t, shared_ptr<share> > share_map;
+    struct shard
+    {
+        share_map shares;
+        mutex lock;
+    };
+    static const size_t num_shards = 16;
 
+    typedef std::pair<time_t, uint64_t> deadline;
 
-// main
-#if defined(_WIN32) && defined(NDEBUG)
-int APIENTRY WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, 
-                     LPSTR lpCmdLine, int nCmdShow)
-{
-    int argc = __argc;
-    char **argv = __argv;
-#else
-int main(int argc, char *argv[])
-{
-#endif
-    // parse the commandline arguments
-    options_description desc("Usage: easytransfer [options] path\nAllowed options");
-    desc.add_options()
-        ("path", value<std::string>(), "path of the file/folder (required, can also the last argument)")
-        ("count,c", value<int>()->default_value(2), "maximum download count before the link expires")
-        ("duration,d", value<unsigned int>()->default_value(30), "time before the link expires, in minutes")
-        ("verbose,v", "turn on verbose mode")
-        ("help,h", "produce this help message")
-        ;
-    positional_options_description pos_desc;
-    pos_desc.add("path", 1);
-    parsed_options parsed = command_line_parser(argc, argv).options(desc).positional(pos_desc).run();
-    variables_map vm;
-    store(parsed, vm);
-    notify(vm);
+    shard& shard_of(uint64_t uuid) { return shards[uuid % num_shards]; }
 
-    if (!vm.count("path"))
+    // refuse further shares if there are none left. returns false if
+    // there still are, so that the daemon never quits on a fresh share.
+    bool close_if_empty();
+
+    // drop the share if it's due, a later update may have postponed it
+    bool expire(uint64_t uuid, time_t now);
+
+    void schedule(uint64_t uuid, time_t expiration_time);
+    void notify();
+    void release(shared_ptr<share> s);
+
+    shard shards[num_shards];
+    mt19937 generator;          // uuids
+    mutex generator_lock;
+    bool closed;                // written with all shard locks held
+
+    // expiration times, stale entries are skipped when they come up
+    std::priority_queue<deadline, std::vector<deadline>, std::greater<deadline> > deadlines;
+    mutex events_lock;          // for deadlines, changed and downloads
+    condition_variable events;
+    bool changed;               // a share went away or was added
+    int downloads;              // in flight
+    bool quitting;
+};
+
+uint64_t share_table::add(const path& p, int count, unsigned int duration)
+{
+    shared_ptr<share> s(new share);
+    s->shared_path = p;
+    s->downloads_left = count;
+    s->expiration_time = time(NULL) + duration;
+
+    // a file's headers are the same for every download, only a directory's
+    // archive may change from one to the next
+    if (ctx)
     {
-        std::cout << desc << '\n';
-        return EXIT_FAILURE;
+        std::string filename = to_utf8(p.filename().c_str());
+        s->headers.reset(mg_prepare_file_headers(ctx, to_utf8(p.c_str()), filename.c_str()),
+                         mg_free_file_headers);
     }
-    else
-        the_path = vm["path"].as<std::string>();
-    count = vm["count"].as<int>();
-    unsigned int duration = vm["duration"].as<unsigned int>() * 60; // * 60 to get seconds
-    expiration_time = time(NULL) * 60 + duration;
-    if (vm.count("help"))
+    boost::system::error_code ec;
+    if (compute_digests && is_regular_file(p, ec))
+        s->digest = digests.add(p);
+
+    // pick an unused uuid
+    for (;;)
     {
-        std::cout << desc << '\n';
-        return 0;
+        {
+            lock_guard<mutex> guard(generator_lock);
+            s->uuid = uniform_int<uint64_t>(0x100000000, 0x4000000000000000)(generator);
+        }
+        shard& sh = shard_of(s->uuid);
+        unique_lock<mutex> guard(sh.lock);
+        if (closed)
+            return 0;
+        if (sh.shares.insert(std::make_pair(s->uuid, s)).second)
+        {
+            guard.unlock();
+            schedule(s->uuid, s->expiration_time);
+            return s->uuid;
+        }
     }
-    verbose = vm.count("verbose") > 0;
-    
+}
 
-    // check the path first
-    log_printf("checking path: %s\n", the_path.c_str());
-    std::string path_status = check_path(the_path);
-    if (path_status.length() > 0)
+share_table::share_ptr share_table::acquire(uint64_t uuid)
+{
+    shard& sh = shard_of(uuid);
+    unique_lock<mutex> guard(sh.lock);
+    share_map::iterator iter = sh.shares.find(uuid);
+    if (iter == sh.shares.end())
+        return share_ptr();
+
+    // the last download takes the share out of the table, concurrent
+    // downloads past the budget find nothing
+    shared_ptr<share> s = iter->second;
+    if (s->expiration_time <= time(NULL))
     {
-        std::cout << path_status << '\n';
-        return EXIT_FAILURE;
+        sh.shares.erase(iter);
+        guard.unlock();
+        notify();
+        return share_ptr();
     }
+    bool spent = --s->downloads_left <= 0;
+    if (spent)
+        sh.shares.erase(iter);
+    guard.unlock();
 
-
-    // call WSAStartup on windows
-#ifdef _WIN32
-    WSADATA wsa_data;
-    int wsa_result = WSAStartup(MAKEWORD(2, 2), &wsa_data);
-    if (wsa_result != NO_ERROR)
+    // count the download until the caller lets go of the share
     {
-        log_printf("WSAStartup() failed: %d\n", wsa_result);
-        return EXIT_FAILURE;
+        lock_guard<mutex> events_guard(events_lock);
+        ++downloads;
     }
-#endif
+    if (spent)
+        notify();
+    return share_ptr(s.get(), bind(&share_table::release, this, s));
+}
+
+bool share_table::find(uint64_t uuid, share& result)
+{
+    shard& sh = shard_of(uuid);
+    lock_guard<mutex> guard(sh.lock);
+    share_map::iterator iter = sh.shares.find(uuid);
+    if (iter == sh.shares.end() || iter->second->expiration_time <= time(NULL))
+        return false;
+    result = *iter->second;
+    return true;
+}
+
+void share_table::release(shared_ptr<share> s)
+{
+    lock_guard<mutex> guard(events_lock);
+    if (--downloads == 0)
+        events.notify_all();
+}
+
+bool share_table::remove(uint64_t uuid)
+{
+    shard& sh = shard_of(uuid);
+    unique_lock<mutex> guard(sh.lock);
+    if (sh.shares.erase(uuid) == 0)
+        return false;
+    guard.unlock();
+    notify();
+    return true;
+}
+
+bool share_table::update(uint64_t uuid, int count, long duration)
+{
+    shard& sh = shard_of(uuid);
+    unique_lock<mutex> guard(sh.lock);
+    share_map::iterator iter = sh.shares.find(uuid);
+    if (iter == sh.shares.end())
+        return false;
+    if (count >= 0)
+        iter->second->downloads_left = count;
+    if (duration >= 0)
+        iter->second->expiration_time = time(NULL) + duration;
+    time_t expiration_time = iter->second->expiration_time;
+    bool spent = iter->second->downloads_left <= 0;
+    if (spent)
+        sh.shares.erase(iter);
+    guard.unlock();
+
+    if (spent)
+        notify();
+    else if (duration >= 0)
+        schedule(uuid, expiration_time);
+    return true;
+}
+
+std::vector<share> share_table::list()
+{
+    std::vector<share> result;
+    for (size_t i = 0; i < num_shards; ++i)
+    {
+        lock_guard<mutex> guard(shards[i].lock);
+        for (share_map::iterator iter = shards[i].shares.begin(); iter != shards[i].shares.end(); ++iter)
+            result.push_back(*iter->second);
+    }
+    return result;
+}
+
+bool share_table::close_if_empty()
+{
+    for (size_t i = 0; i < num_shards; ++i)
+        shards[i].lock.lock();
+    bool empty = true;
+    for (size_t i = 0; i < num_shards; ++i)
+        empty = empty && shards[i].shares.empty();
+    closed = empty;
+    for (size_t i = 0; i < num_shards; ++i)
+        shards[i].lock.unlock();
+    return empty;
+}
+
+bool share_table::expire(uint64_t uuid, time_t now)
+{
+    shard& sh = shard_of(uuid);
+    lock_guard<mutex> guard(sh.lock);
+    share_map::iterator iter = sh.shares.find(uuid);
+    if (iter == sh.shares.end() || iter->second->expiration_time > now)
+        return false;
+    log_printf("share %llu expired\n", (unsigned long long)uuid);
+    sh.shares.erase(iter);
+    return true;
+}
+
+void share_table::schedule(uint64_t uuid, time_t expiration_time)
+{
+    lock_guard<mutex> guard(events_lock);
+    deadlines.push(deadline(expiration_time, uuid));
+    changed = true;
+    events.notify_all();
+}
+
+void share_table::notify()
+{
+    lock_guard<mutex> guard(events_lock);
+    changed = true;
+    events.notify_all();
+}
+
+bool share_table::wait_until_empty()
+{
+    unique_lock<mutex> guard(events_lock);
+    for (;;)
+    {
+        if (quitting)
+            return false;
+
+        // pop what's due, the locks of the shards are taken without ours
+        time_t now = time(NULL);
+        while (!deadlines.empty() && deadlines.top().first <= now)
+        {
+            uint64_t uuid = deadlines.top().second;
+            deadlines.pop();
+            guard.unlock();
+            bool expired = expire(uuid, now);
+            guard.lock();
+            changed = changed || expired;
+        }
+
+        if (changed)
+        {
+            changed = false;
+            guard.unlock();
+            bool empty = close_if_empty();
+            guard.lock();
+            if (empty)
+                return true;
+            continue;
+        }
+
+        // sleep until the next deadline or until something happens
+        if (deadlines.empty())
+            events.wait(guard);
+        else
+            events.timed_wait(guard, posix_time::from_time_t(deadlines.top().first));
+    }
+}
+
+bool share_table::wait_for_downloads()
+{
+    unique_lock<mutex> guard(events_lock);
+    while (downloads > 0 && !quitting)
+        events.wait(guard);
+    return !quitting;
+}
+
+void share_table::quit()
+{
+    lock_guard<mutex> guard(events_lock);
+    quitting = true;
+    events.notify_all();
+}
+
+share_table shares;             // everything being shared
+
+
+std::string content_digest::hex() const
+{
+    static const char digits[] = "0123456789abcdef";
+    std::string result;
+    for (size_t i = 0; i < sizeof(sha256); ++i)
+    {
+        result += digits[sha256[i] >> 4];
+        result += digits[sha256[i] & 15];
+    }
+    return result;
+}
+
+std::string content_digest::base64() const
+{
+    static const char digits[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string result;
+    for (size_t i = 0; i < sizeof(sha256); i += 3)
+    {
+        unsigned int n = sha256[i] << 16;
+        if (i + 1 < sizeof(sha256))
+            n |= sha256[i + 1] << 8;
+        if (i + 2 < sizeof(sha256))
+            n |= sha256[i + 2];
+        result += digits[n >> 18];
+        result += digits[(n >> 12) & 63];
+        result += i + 1 < sizeof(sha256) ? digits[(n >> 6) & 63] : '=';
+        result += i + 2 < sizeof(sha256) ? digits[n & 63] : '=';
+    }
+    return result;
+}
+
+bool content_digest::matches(const path& p) const
+{
+    boost::system::error_code ec;
+    uintmax_t current_size = file_size(p, ec);
+    if (ec)
+        return false;
+    time_t current_mtime = last_write_time(p, ec);
+    return !ec && current_size == size && current_mtime == mtime;
+}
+
+digest_queue::~digest_queue()
+{
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+        wakeup.notify_all();
+    }
+    if (worker)
+        worker->join();
+}
+
+digest_queue::handle digest_queue::add(const path& p)
+{
+    handle job(new digest_job);
+    job->file = p;
+    job->queued = true;
+
+    lock_guard<mutex> guard(lock);
+    pending.push_back(job);
+    if (!worker)
+        worker.reset(new thread(bind(&digest_queue::run, this)));
+    wakeup.notify_all();
+    return job;
+}
+
+bool digest_queue::get(const handle& job, content_digest& digest)
+{
+    {
+        lock_guard<mutex> guard(lock);
+        digest = job->digest;
+    }
+    return digest.known && digest.matches(job->file);
+}
+
+void digest_queue::hurry(const handle& job)
+{
+    content_digest digest;
+    if (get(job, digest))
+        return;
+
+    lock_guard<mutex> guard(lock);
+    std::deque<handle>::iterator iter = std::find(pending.begin(), pending.end(), job);
+    if (iter != pending.end())
+        pending.erase(iter);
+    else if (job->queued)
+        return;                 // being hashed right now
+    job->queued = true;
+    pending.push_front(job);
+    if (!worker)
+        worker.reset(new thread(bind(&digest_queue::run, this)));
+    wakeup.notify_all();
+}
+
+void digest_queue::run()
+{
+    unique_lock<mutex> guard(lock);
+    for (;;)
+    {
+        while (pending.empty() && !stopping)
+            wakeup.wait(guard);
+        if (stopping)
+            return;
+        handle job = pending.front();
+        pending.pop_front();
+        guard.unlock();
+
+        content_digest digest;
+        bool ok = hash_file(job->file, digest);
+
+        guard.lock();
+        job->queued = false;
+        if (ok)
+            job->digest = digest;
+    }
+}
+
+// false if the file can't be read, changes while it's read, or the queue
+// is stopping
+bool digest_queue::hash_file(const path& p, content_digest& digest)
+{
+    boost::system::error_code ec;
+    digest.size = file_size(p, ec);
+    if (!ec)
+        digest.mtime = last_write_time(p, ec);
+    FILE *file = ec ? NULL : FOPEN(p.c_str(), T("rb"));
+    if (!file)
+        return false;
+
+    log_printf("computing the sha-256 of %s with %s\n", p.c_str(), sha256_implementation());
+    struct sha256 sha;
+    sha256_init(&sha);
+    std::vector<char> buffer(1024 * 1024);
+    size_t length;
+    bool stopped = false;
+    while (!stopped && (length = fread(&buffer[0], 1, buffer.size(), file)) > 0)
+    {
+        sha256_update(&sha, &buffer[0], length);
+        lock_guard<mutex> guard(lock);
+        stopped = stopping;
+    }
+    bool ok = !stopped && !ferror(file);
+    fclose(file);
+    sha256_final(&sha, digest.sha256);
+
+    // a file that changed meanwhile gets hashed again by the next hurry()
+    digest.known = ok && digest.matches(p);
+    return digest.known;
+}
+
+
+// compressed archives of directory shares, keyed by a fingerprint of the
+// tree (paths, sizes and mtimes). repeat and concurrent downloads of an
+// unchanged directory share one build, and each build gets its own file,
+// so downloaders never clobber each other's archive.
+class archive_cache
+{
+public:
+    // keeps the archive file alive, it's deleted once the cache and all
+    // downloads are done with it
+    typedef shared_ptr<const path> handle;
+
+    archive_cache() : max_bytes(1024 * 1024 * 1024), total_bytes(0) {}
+
+    // return an up-to-date archive of directory_path. waits for a build in
+    // progress, or builds it if build is set. returns NULL on failure, or
+    // if there's no archive and build isn't set. digest, if given, gets
+    // the archive's, which is computed while the archive is written.
+    handle get(const path& directory_path, bool build = true, content_digest *digest = NULL);
+
+    // forget all archives, deleting the files no download is using
+    void clear();
+
+    uintmax_t max_bytes;    // evict least recently used archives above this
+
+private:
+    struct entry
+    {
+        path directory;
+        handle archive;
+        bool building;
+        uintmax_t size;
+        time_t last_used;
+        content_digest digest;
+    };
+    typedef std::map<uint64_t, shared_ptr<entry> > entry_map;
+
+    static uint64_t fingerprint(const path& directory_path);
+    static void remove_archive(const path *p);
+    void evict(uint64_t keep);
+
+    entry_map entries;
+    uintmax_t total_bytes;
+    mutex lock;
+    condition_variable built;
+};
+
+archive_cache archives;         // cache of compressed directory shares
+
+
+#ifndef EASYTRANSFER_NO_MAIN
+#ifndef _WIN32
+// takes the signals blocked in every thread. the first one lets main shut
+// down, taking whatever locks it needs, another one quits at once.
+static void wait_for_signals(sigset_t signals)
+{
+    int code;
+    bool quitting = false;
+    while (sigwait(&signals, &code) == 0)
+    {
+        if (!quitting)
+        {
+            shares.quit();
+            quitting = true;
+            continue;
+        }
+        signal(code, SIG_DFL);
+        pthread_sigmask(SIG_UNBLOCK, &signals, NULL);
+        raise(code);
+    }
+}
+#else
+// the runtime calls it on a thread of its own, so it can take locks
+static void sig_hand(int code)
+{
+    shares.quit();
+}
+#endif
+#endif
+
+
+// pigz-style parallel gzip compressor. the input is cut into blocks that
+// worker threads deflate independently, each primed with the last 32 KB of
+// the previous block, and a writer thread stitches them back together in
+// order into a single gzip member.
+class parallel_gzip
+{
+public:
+    parallel_gzip(const output_fn& output, unsigned int threads,
+                  bool store_incompressible = false,
+                  int level = Z_DEFAULT_COMPRESSION);
+    ~parallel_gzip();
+
+    bool write(const void *data, size_t length);
+    bool finish();
+
+private:
+    struct block
+    {
+        std::vector<unsigned char> in;      // uncompressed data
+        std::vector<unsigned char> out;     // raw deflate data
+        shared_ptr<block> previous;         // dictionary, until compressed
+        uLong crc;                          // crc32 of in
+        bool last;                          // ends the deflate stream
+        bool done;                          // out is ready
+    };
+    typedef shared_ptr<block> block_ptr;
+
+    static const size_t block_size = 256 * 1024;
+    static const size_t window_size = 32 * 1024;
+
+    void submit(bool last);
+    void compress_blocks();
+    void write_blocks();
+    void compress(block& b, z_stream& stream);
+    static bool is_incompressible(const std::vector<unsigned char>& data);
+
+    output_fn output;
+    bool store_incompressible;      // deflate random-looking blocks at level 0
+    int level;
+    size_t max_pending;             // bounds memory use
+    block_ptr current;              // block being filled by write()
+    block_ptr previous;             // last submitted block
+
+    mutex lock;
+    condition_variable changed;
+    std::deque<block_ptr> jobs;     // waiting for a compressor
+    std::deque<block_ptr> pending;  // in input order, waiting for the writer
+    bool finished;                  // last block submitted
+    bool failed;                    // output failed, stop writing
+
+    thread_group compressors;
+    thread writer;
+};
+
+// std::min takes these by reference, so they need a definition
+const size_t parallel_gzip::block_size;
+const size_t parallel_gzip::window_size;
+
+parallel_gzip::parallel_gzip(const output_fn& output, unsigned int threads,
+                             bool store_incompressible, int level)
+    : output(output), store_incompressible(store_incompressible),
+      level(level), max_pending(2 * threads),
+      current(new block), finished(false), failed(false)
+{
+    for (unsigned int i = 0; i < threads; ++i)
+        compressors.create_thread(bind(&parallel_gzip::compress_blocks, this));
+    writer = thread(bind(&parallel_gzip::write_blocks, this));
+}
+
+parallel_gzip::~parallel_gzip()
+{
+    if (!finished)
+    {
+        {
+            lock_guard<mutex> guard(lock);
+            failed = true;
+        }
+        finish();
+    }
+}
+
+bool parallel_gzip::write(const void *data, size_t length)
+{
+    const unsigned char *p = static_cast<const unsigned char*>(data);
+    while (length > 0)
+    {
+        size_t n = std::min(length, block_size - current->in.size());
+        current->in.insert(current->in.end(), p, p + n);
+        p += n;
+        length -= n;
+        if (current->in.size() == block_size)
+            submit(false);
+    }
+
+    lock_guard<mutex> guard(lock);
+    return !failed;
+}
+
+bool parallel_gzip::finish()
+{
+    submit(true);
+    {
+        lock_guard<mutex> guard(lock);
+        finished = true;
+        changed.notify_all();
+    }
+    writer.join();
+    compressors.join_all();
+
+    return !failed;
+}
+
+// hand the current block to the compressors, waiting if too many are in flight
+void parallel_gzip::submit(bool last)
+{
+    current->last = last;
+    current->done = false;
+    current->previous = previous;
+
+    unique_lock<mutex> guard(lock);
+    while (pending.size() >= max_pending && !failed)
+        changed.wait(guard);
+    jobs.push_back(current);
+    pending.push_back(current);
+    changed.notify_all();
+    guard.unlock();
+
+    previous = current;
+    current.reset(new block);
+}
+
+void parallel_gzip::compress_blocks()
+{
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    deflateInit2(&stream, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+
+    unique_lock<mutex> guard(lock);
+    for (;;)
+    {
+        while (jobs.empty() && !finished)
+            changed.wait(guard);
+        if (jobs.empty())
+            break;
+        block_ptr b = jobs.front();
+        jobs.pop_front();
+        guard.unlock();
+
+        compress(*b, stream);
+
+        guard.lock();
+        b->done = true;
+        changed.notify_all();
+    }
+    guard.unlock();
+
+    deflateEnd(&stream);
+}
+
+// deflate one block. all blocks but the last end on a byte boundary with a
+// sync flush, so the pieces concatenate into one valid deflate stream.
+void parallel_gzip::compress(block& b, z_stream& stream)
+{
+    deflateReset(&stream);
+    if (store_incompressible)
+        deflateParams(&stream, is_incompressible(b.in) ? 0 : level, Z_DEFAULT_STRATEGY);
+    if (b.previous)
+    {
+        const std::vector<unsigned char>& dictionary = b.previous->in;
+        size_t n = std::min(dictionary.size(), window_size);
+        deflateSetDictionary(&stream, &dictionary[0] + dictionary.size() - n, n);
+        b.previous.reset();
+    }
+
+    b.crc = crc32(crc32(0, Z_NULL, 0), b.in.empty() ? Z_NULL : &b.in[0], b.in.size());
+    b.out.resize(deflateBound(&stream, b.in.size()) + 64);
+    stream.next_in = b.in.empty() ? Z_NULL : &b.in[0];
+    stream.avail_in = b.in.size();
+    stream.next_out = &b.out[0];
+    stream.avail_out = b.out.size();
+    while (deflate(&stream, b.last ? Z_FINISH : Z_SYNC_FLUSH) == Z_OK &&
+           stream.avail_out == 0)
+    {
+        size_t used = b.out.size();
+        b.out.resize(used * 2);
+        stream.next_out = &b.out[used];
+        stream.avail_out = b.out.size() - used;
+    }
+    b.out.resize(b.out.size() - stream.avail_out);
+}
+
+// estimate the entropy of a block from a sample of its bytes. media and
+// already compressed files come close to 8 bits per byte, and deflating
+// them burns CPU for nothing.
+bool parallel_gzip::is_incompressible(const std::vector<unsigned char>& data)
+{
+    const size_t sample_size = 16 * 1024;
+    if (data.size() < sample_size)
+        return false;
+
+    // sample evenly spaced 1 KB runs, so both halves of a block that
+    // straddles two files get looked at
+    unsigned int histogram[256] = { 0 };
+    size_t stride = data.size() / 16;
+    for (size_t run = 0; run < 16; ++run)
+        for (size_t i = run * stride; i < run * stride + sample_size / 16; ++i)
+            ++histogram[data[i]];
+
+    double entropy = 0;
+    for (int i = 0; i < 256; ++i)
+    {
+        if (histogram[i] == 0)
+            continue;
+        double p = double(histogram[i]) / sample_size;
+        entropy -= p * std::log(p) / std::log(2.0);
+    }
+    return entropy > 7.5;
+}
+
+// write the gzip header, the blocks in order and the trailer
+void parallel_gzip::write_blocks()
+{
+    static const unsigned char header[10] = {
+        0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3
+    };
+    bool ok = output(header, sizeof(header));
+    uLong crc = crc32(0, Z_NULL, 0);
+    uint32_t total = 0;
+
+    unique_lock<mutex> guard(lock);
+    for (;;)
+    {
+        while ((pending.empty() || !pending.front()->done) &&
+               !(finished && pending.empty()))
+            changed.wait(guard);
+        if (pending.empty())
+            break;
+        block_ptr b = pending.front();
+        pending.pop_front();
+        if (!ok)
+            failed = true;
+        changed.notify_all();
+        guard.unlock();
+
+        if (ok && !b->out.empty())
+            ok = output(&b->out[0], b->out.size());
+        crc = crc32_combine(crc, b->crc, b->in.size());
+        total += b->in.size();
+
+        if (ok && b->last)
+        {
+            unsigned char trailer[8];
+            for (int i = 0; i < 4; ++i)
+            {
+                trailer[i] = (crc >> (8 * i)) & 0xff;
+                trailer[4 + i] = (total >> (8 * i)) & 0xff;
+            }
+            ok = output(trailer, sizeof(trailer));
+        }
+
+        guard.lock();
+    }
+    if (!ok)
+        failed = true;
+}
+
+
+// tell the kernel that file is read sequentially and has reached offset:
+// prefetch the next chunk, and drop the one behind the previous chunk from
+// the page cache so that huge directories don't push everything else out
+void advise_sequential(FILE *file, off_t offset)
+{
+#ifdef POSIX_FADV_SEQUENTIAL
+    off_t chunk = io_chunk_size;
+    posix_fadvise(fileno(file), offset, chunk, POSIX_FADV_WILLNEED);
+    if (offset >= 2 * chunk)
+        posix_fadvise(fileno(file), offset - 2 * chunk, chunk, POSIX_FADV_DONTNEED);
+#endif
+}
+
+// progress of the archives being built, for /metrics. each build counts
+// into its own cache line and only the readers take a lock.
+struct compression_counters
+{
+    compression_counters();
+    ~compression_counters();
+
+    char pad_before[64];
+    volatile uintmax_t bytes_in;    // read from the shared files
+    volatile uintmax_t bytes_out;   // compressed output
+    char pad_after[64];
+};
+
+class compression_stats
+{
+public:
+    compression_stats() : done_in(0), done_out(0) {}
+
+    void add(compression_counters *counters);
+    void remove(compression_counters *counters);
+
+    // totals so far, and the number of archives being built
+    void get(uintmax_t& bytes_in, uintmax_t& bytes_out, size_t& in_progress);
+
+private:
+    std::vector<compression_counters*> active;
+    uintmax_t done_in;          // of the finished builds
+    uintmax_t done_out;
+    mutex lock;
+};
+
+compression_stats compression;  // all archive builds
+
+compression_counters::compression_counters() : bytes_in(0), bytes_out(0)
+{
+    compression.add(this);
+}
+
+compression_counters::~compression_counters()
+{
+    compression.remove(this);
+}
+
+void compression_stats::add(compression_counters *counters)
+{
+    lock_guard<mutex> guard(lock);
+    active.push_back(counters);
+}
+
+void compression_stats::remove(compression_counters *counters)
+{
+    lock_guard<mutex> guard(lock);
+    active.erase(std::find(active.begin(), active.end(), counters));
+    done_in += counters->bytes_in;
+    done_out += counters->bytes_out;
+}
+
+void compression_stats::get(uintmax_t& bytes_in, uintmax_t& bytes_out, size_t& in_progress)
+{
+    lock_guard<mutex> guard(lock);
+    bytes_in = done_in;
+    bytes_out = done_out;
+    for (size_t i = 0; i < active.size(); ++i)
+    {
+        bytes_in += active[i]->bytes_in;
+        bytes_out += active[i]->bytes_out;
+    }
+    in_progress = active.size();
+}
+
+
+// a file or directory found by walk_directory()
+struct walk_entry
+{
+    path file;
+    uintmax_t size;             // 0 for directories
+    std::time_t mtime;
+    uintmax_t inode;
+    bool directory;
+};
+
+// orders the entries by inode, which on most filesystems follows the order
+// in which they were created and roughly where their data is on the disk
+bool inode_order(const walk_entry& a, const walk_entry& b)
+{
+    if (a.inode != b.inode)
+        return a.inode < b.inode;
+    return a.file < b.file;
+}
+
+bool is_directory_entry(const walk_entry& entry)
+{
+    return entry.directory;
+}
+
+#ifndef _WIN32
+// walks a tree with several threads, each reading whole directories and
+// taking the metadata of their entries with one statx() or fstatat() per
+// entry. symlinks to files are followed, symlinks to directories and special
+// files are skipped.
+class directory_walker
+{
+public:
+    directory_walker() : busy(0) {}
+
+    std::vector<walk_entry> walk(const path& directory_path, unsigned int threads);
+
+private:
+    void walk_directories();
+    void read_directory(const path& directory, std::vector<walk_entry>& found,
+                        std::vector<path>& subdirectories);
+    static bool stat_entry(int directory_fd, const char *name, bool follow,
+                           mode_t& mode, walk_entry& entry);
+
+    mutex lock;
+    condition_variable changed;
+    std::vector<path> directories;  // waiting for a walker
+    unsigned int busy;              // walkers reading a directory
+    std::vector<walk_entry> entries;
+};
+
+std::vector<walk_entry> directory_walker::walk(const path& directory_path, unsigned int threads)
+{
+    directories.push_back(directory_path);
+    thread_group walkers;
+    for (unsigned int i = 0; i < std::max(threads, 1u); ++i)
+        walkers.create_thread(bind(&directory_walker::walk_directories, this));
+    walkers.join_all();
+
+    std::vector<walk_entry> result;
+    result.swap(entries);
+    return result;
+}
+
+void directory_walker::walk_directories()
+{
+    std::vector<walk_entry> found;
+    std::vector<path> subdirectories;
+
+    unique_lock<mutex> guard(lock);
+    for (;;)
+    {
+        while (directories.empty() && busy > 0)
+            changed.wait(guard);
+        if (directories.empty())
+            break;
+        path directory = directories.back();
+        directories.pop_back();
+        ++busy;
+        guard.unlock();
+
+        read_directory(directory, found, subdirectories);
+
+        guard.lock();
+        --busy;
+        directories.insert(directories.end(), subdirectories.begin(), subdirectories.end());
+        subdirectories.clear();
+        changed.notify_all();
+    }
+    entries.insert(entries.end(), found.begin(), found.end());
+}
+
+void directory_walker::read_directory(const path& directory, std::vector<walk_entry>& found,
+                                      std::vector<path>& subdirectories)
+{
+    int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+    DIR *dir = fd < 0 ? NULL : fdopendir(fd);
+    if (!dir)
+    {
+        log_printf("failed to read directory %s\n", directory.c_str());
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+
+    // the directory's own entry, its metadata comes with the open descriptor
+    struct stat st;
+    if (fstat(fd, &st) == 0)
+    {
+        walk_entry self = { directory, 0, st.st_mtime, (uintmax_t)st.st_ino, true };
+        found.push_back(self);
+    }
+
+    // readdir() fetches the entries in large getdents() batches, and their
+    // types often come with them
+    while (struct dirent *d = readdir(dir))
+    {
+        if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+            continue;
+
+        walk_entry entry;
+        entry.file = directory / d->d_name;
+        entry.directory = false;
+        mode_t mode = 0;
+        if (d->d_type == DT_DIR)
+        {
+            subdirectories.push_back(entry.file);
+            continue;
+        }
+        if (d->d_type != DT_REG && d->d_type != DT_LNK && d->d_type != DT_UNKNOWN)
+            continue;
+        if (!stat_entry(fd, d->d_name, d->d_type == DT_LNK, mode, entry))
+        {
+            log_printf("failed to stat %s\n", entry.file.c_str());
+            continue;
+        }
+        if (d->d_type == DT_UNKNOWN && S_ISDIR(mode))
+            subdirectories.push_back(entry.file);
+        else if (d->d_type == DT_UNKNOWN && S_ISLNK(mode) &&
+                 stat_entry(fd, d->d_name, true, mode, entry) && S_ISREG(mode))
+            found.push_back(entry);
+        else if (S_ISREG(mode))
+            found.push_back(entry);
+    }
+    closedir(dir);
+}
+
+// type, size, mtime and inode of name in the directory, asking only for
+// those where statx() is available
+bool directory_walker::stat_entry(int directory_fd, const char *name, bool follow,
+                                  mode_t& mode, walk_entry& entry)
+{
+    int flags = follow ? 0 : AT_SYMLINK_NOFOLLOW;
+#ifdef STATX_BASIC_STATS
+    struct statx stx;
+    if (statx(directory_fd, name, flags, STATX_TYPE | STATX_SIZE | STATX_MTIME | STATX_INO, &stx) != 0)
+        return false;
+    mode = stx.stx_mode;
+    entry.size = stx.stx_size;
+    entry.mtime = stx.stx_mtime.tv_sec;
+    entry.inode = stx.stx_ino;
+#else
+    struct stat st;
+    if (fstatat(directory_fd, name, &st, flags) != 0)
+        return false;
+    mode = st.st_mode;
+    entry.size = st.st_size;
+    entry.mtime = st.st_mtime;
+    entry.inode = st.st_ino;
+#endif
+    return true;
+}
+#endif
+
+// every regular file and directory under directory_path, directory_path
+// included, in inode order
+std::vector<walk_entry> walk_directory(const path& directory_path, unsigned int threads)
+{
+#ifndef _WIN32
+    directory_walker walker;
+    std::vector<walk_entry> entries = walker.walk(directory_path, threads);
+#else
+    std::vector<walk_entry> entries;
+    boost::system::error_code ec;
+    recursive_directory_iterator end;
+    for (recursive_directory_iterator iter(directory_path, ec); iter != end; iter.increment(ec))
+    {
+        walk_entry entry;
+        entry.file = iter->path();
+        entry.directory = is_directory(iter->status());
+        entry.size = entry.directory ? 0 : file_size(entry.file, ec);
+        entry.mtime = last_write_time(entry.file, ec);
+        entry.inode = 0;
+        entries.push_back(entry);
+        if (ec)
+            break;
+    }
+#endif
+    std::sort(entries.begin(), entries.end(), inode_order);
+    return entries;
+}
+
+// opens the files to archive and reads their first chunk ahead of the
+// archiver, in order, with several threads. small files are read whole,
+// the archiver reads the rest of larger ones itself. at most max_ahead files
+// are kept waiting, which bounds the memory and the open descriptors.
+class file_prefetcher
+{
+public:
+    struct file
+    {
+        file() : handle(NULL), opened(false), complete(false) {}
+        ~file() { if (handle) fclose(handle); }
+
+        FILE *handle;               // after head, NULL if done or not opened
+        std::vector<char> head;     // first chunk of the file
+        bool opened;
+        bool complete;              // head is the whole file
+    };
+    typedef shared_ptr<file> file_ptr;
+
+    file_prefetcher(const std::vector<walk_entry>& files, unsigned int threads);
+    ~file_prefetcher();
+
+    // the next file, waits until it has been read
+    file_ptr next();
+
+private:
+    void prefetch_files();
+
+    const std::vector<walk_entry>& files;
+    size_t max_ahead;
+    std::vector<file_ptr> ready;    // by index in files
+    size_t next_read;               // next file for a prefetch thread
+    size_t next_out;                // next file for the archiver
+    bool stopping;
+
+    mutex lock;
+    condition_variable readable;    // the archiver's next file is ready
+    condition_variable writable;    // the readers can go ahead again
+    thread_group readers;
+};
+
+file_prefetcher::file_prefetcher(const std::vector<walk_entry>& files, unsigned int threads)
+    : files(files), max_ahead(8 * std::max(threads, 1u)), ready(files.size()),
+      next_read(0), next_out(0), stopping(false)
+{
+    for (unsigned int i = 0; i < std::max(threads, 1u); ++i)
+        readers.create_thread(bind(&file_prefetcher::prefetch_files, this));
+}
+
+file_prefetcher::~file_prefetcher()
+{
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+        writable.notify_all();
+    }
+    readers.join_all();
+}
+
+file_prefetcher::file_ptr file_prefetcher::next()
+{
+    unique_lock<mutex> guard(lock);
+    while (!ready[next_out])
+        readable.wait(guard);
+    file_ptr f;
+    f.swap(ready[next_out++]);
+    // wake the readers once half of the window is free, not for every file
+    if (next_read - next_out == max_ahead / 2)
+        writable.notify_all();
+    return f;
+}
+
+void file_prefetcher::prefetch_files()
+{
+    unique_lock<mutex> guard(lock);
+    for (;;)
+    {
+        while (!stopping && next_read < files.size() && next_read >= next_out + max_ahead)
+            writable.wait(guard);
+        if (stopping || next_read == files.size())
+            break;
+        size_t i = next_read++;
+        guard.unlock();
+
+        file_ptr f(new file);
+        f->handle = FOPEN(files[i].file.c_str(), T("rb"));
+        f->opened = f->handle != NULL;
+        if (f->handle)
+        {
+#ifdef POSIX_FADV_SEQUENTIAL
+            posix_fadvise(fileno(f->handle), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+            // large reads, the stdio buffer would only add a copy
+            setvbuf(f->handle, NULL, _IONBF, 0);
+            advise_sequential(f->handle, 0);
+            // one byte more than the walk found tells if the file is whole
+            size_t length = (size_t)std::min<uintmax_t>(files[i].size + 1, io_chunk_size);
+            f->head.resize(length);
+            f->head.resize(fread(&f->head[0], 1, length, f->handle));
+            f->complete = f->head.size() < length;
+            if (f->complete)
+            {
+                fclose(f->handle);
+                f->handle = NULL;
+            }
+        }
+
+        guard.lock();
+        ready[i] = f;
+        if (i == next_out)
+            readable.notify_one();
+    }
+}
+
+// write every file under directory_path into an opened archive. stops at
+// the first write that fails, e.g. because the client went away, and
+// returns false then.
+// assumes that directory_path is valid
+bool write_directory(struct archive *a, const path& directory_path,
+                     compression_counters& progress)
+{
+    struct archive_entry *entry = archive_entry_new();
+    std::vector<char> buffer(io_chunk_size);
+    
+    // offset of the parent directory's full path
+	int len = (directory_path.parent_path().native().length() + 1);
+
+    std::vector<walk_entry> files = walk_directory(directory_path, io_threads);
+    files.erase(std::remove_if(files.begin(), files.end(), is_directory_entry), files.end());
+
+    file_prefetcher prefetcher(files, io_threads);
+    bool ok = true;
+    for (size_t i = 0; ok && i < files.size(); ++i)
+    {
+        const path& p = files[i].file;
+        file_prefetcher::file_ptr f = prefetcher.next();
+        if (!f->opened)
+        {
+            log_printf("failed to open file for compression: %s\n", p.c_str());
+            continue;
+        }
+        
+        // set headers
+        archive_entry_set_pathname(entry, to_utf8(p.c_str()) + len); // add the offset to get rid of the absolute path
+        archive_entry_set_size(entry, files[i].size);
+        archive_entry_set_filetype(entry, AE_IFREG);
+        archive_entry_set_perm(entry, 0644);
+        int status = archive_write_header(a, entry);
+        if (status == ARCHIVE_FATAL)
+        {
+            ok = false;
+            break;
+        }
+        if (status < ARCHIVE_WARN)
+        {
+            log_printf("failed to add %s to the archive: %s\n", p.c_str(), archive_error_string(a));
+            archive_entry_clear(entry);
+            continue;
+        }
+
+        if (!f->head.empty() && archive_write_data(a, &f->head[0], f->head.size()) < 0)
+            ok = false;
+        off_t offset = f->head.size();
+        progress.bytes_in += f->head.size();
+        size_t read;
+        while (ok && !f->complete)
+        {
+            advise_sequential(f->handle, offset);
+            read = fread(&buffer[0], 1, buffer.size(), f->handle);
+            if (archive_write_data(a, &buffer[0], read) < 0)
+                ok = false;
+            offset += read;
+            progress.bytes_in += read;
+            f->complete = read < buffer.size();
+        }
+        archive_entry_clear(entry);
+    }
+
+    // the prefetcher's readers stop when it goes out of scope
+    if (!ok)
+        log_printf("failed to write the archive of %s\n", directory_path.c_str());
+    archive_entry_free(entry);
+    return ok;
+}
+
+
+// output function that appends to a file
+struct file_output
+{
+    FILE *file;
+
+    bool operator()(const void *data, size_t length) const
+    {
+        return fwrite(data, 1, length, file) == length;
+    }
+};
+
+// output function that sends to a connection, as HTTP chunks or raw until
+// the connection is closed
+struct http_output
+{
+    mg_connection *conn;
+    bool chunked;
+
+    bool operator()(const void *data, size_t length) const
+    {
+        if (length == 0)
+            return true;
+        if (chunked && mg_printf(conn, "%lx\r\n", (unsigned long)length) <= 0)
+            return false;
+        if (mg_write(conn, data, length) != (int)length)
+            return false;
+        return !chunked || mg_write(conn, "\r\n", 2) == 2;
+    }
+};
+
+// output function that hashes what goes through it
+struct hashing_output
+{
+    output_fn output;
+    struct sha256 *sha;
+
+    bool operator()(const void *data, size_t length) const
+    {
+        sha256_update(sha, data, length);
+        return output(data, length);
+    }
+};
+
+// output function that counts what goes through it
+struct counted_output
+{
+    output_fn output;
+    compression_counters *progress;
+
+    bool operator()(const void *data, size_t length) const
+    {
+        progress->bytes_out += length;
+        return output(data, length);
+    }
+};
+
+// where libarchive's output goes, either straight to the output function
+// or through the parallel compressor first
+struct archive_sink
+{
+    output_fn output;
+    parallel_gzip *gzip;
+};
+
+ssize_t archive_sink_write(struct archive *a, void *client_data,
+                           const void *buffer, size_t length)
+{
+    archive_sink *sink = static_cast<archive_sink*>(client_data);
+    bool ok = sink->gzip ? sink->gzip->write(buffer, length)
+                         : sink->output(buffer, length);
+    return ok ? length : -1;
+}
+
+int archive_sink_close(struct archive *a, void *client_data)
+{
+    archive_sink *sink = static_cast<archive_sink*>(client_data);
+    if (sink->gzip && !sink->gzip->finish())
+        return ARCHIVE_FATAL;
+    return ARCHIVE_OK;
+}
+
+// write a directory as a tar archive compressed with the selected codec
+// into output. gzip goes through parallel_gzip unless it's restricted to a
+// single thread, the other codecs use libarchive's filters.
+// assumes that directory_path is valid
+bool write_archive(const path& directory_path, const output_fn& uncounted_output)
+{
+    compression_counters progress;
+    counted_output output = { uncounted_output, &progress };
+
+    archive_sink sink;
+    sink.output = output;
+    sink.gzip = NULL;
+    scoped_ptr<parallel_gzip> gzip;
+
+    struct archive *a = archive_write_new();
+    std::string codec_name = codec->name;
+    if (codec_name == "auto" || (codec_name == "gzip" && compress_threads > 1))
+    {
+        gzip.reset(new parallel_gzip(output, compress_threads, codec_name == "auto"));
+        sink.gzip = gzip.get();
+    }
+    else if (codec_name == "gzip")
+        archive_write_set_compression_gzip(a);
+    else if (codec_name == "zstd")
+    {
+        archive_write_add_filter_zstd(a);
+        std::string threads = lexical_cast<std::string>(compress_threads);
+        if (archive_write_set_filter_option(a, "zstd", "threads", threads.c_str()) != ARCHIVE_OK)
+            log_printf("zstd compression is single threaded: %s\n", archive_error_string(a));
+    }
+    else if (codec_name == "lz4")
+        archive_write_add_filter_lz4(a);
+    archive_write_set_format_pax_restricted(a);
+    archive_write_set_bytes_per_block(a, 64 * 1024);
+    archive_write_set_bytes_in_last_block(a, 1); // don't pad the output
+    archive_write_open(a, &sink, NULL, archive_sink_write, archive_sink_close);
+    bool ok = write_directory(a, directory_path, progress);
+
+    ok = archive_write_close(a) == ARCHIVE_OK && ok;
+    archive_write_finish(a);
+    return ok;
+}
+
+
+// compress and entire directory, and hash the archive on the way if
+// digest is given. its size and mtime are left to the caller.
+// assumes that directory_path is valid
+bool compress_directory(const path& directory_path,
+                        const path& outname,
+                        content_digest *digest)
+{
+    log_printf("compressing directory \"%s\" into \"%s\" with %s on %u thread(s)\n",
+               directory_path.c_str(), outname.c_str(), codec->name, compress_threads);
+
+    FILE *file = FOPEN(outname.c_str(), T("wb"));
+    if (!file)
+    {
+        log_printf("failed to create archive: %s\n", outname.c_str());
+        return false;
+    }
+    file_output output = { file };
+    struct sha256 sha;
+    sha256_init(&sha);
+    hashing_output hashed = { output, &sha };
+    bool ok = digest ? write_archive(directory_path, hashed) : write_archive(directory_path, output);
+    ok = fclose(file) == 0 && ok;
+    if (ok && digest)
+    {
+        sha256_final(&sha, digest->sha256);
+        digest->known = true;
+    }
+    return ok;
+}
+
+
+// FNV-1a hash of everything in the tree that affects the archive
+uint64_t archive_cache::fingerprint(const path& directory_path)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    struct fnv
+    {
+        static void add(uint64_t& hash, const void *data, size_t length)
+        {
+            const unsigned char *p = static_cast<const unsigned char*>(data);
+            for (size_t i = 0; i < length; ++i)
+                hash = (hash ^ p[i]) * 1099511628211ULL;
+        }
+    };
+
+    const path::string_type& root = directory_path.native();
+    fnv::add(hash, root.data(), root.size() * sizeof(root[0]));
+
+    std::vector<walk_entry> entries = walk_directory(directory_path, io_threads);
+    for (size_t i = 0; i < entries.size(); ++i)
+    {
+        const path::string_type& name = entries[i].file.native();
+        fnv::add(hash, name.data(), name.size() * sizeof(name[0]));
+        fnv::add(hash, &entries[i].size, sizeof(entries[i].size));
+        fnv::add(hash, &entries[i].mtime, sizeof(entries[i].mtime));
+    }
+    return hash;
+}
+
+void archive_cache::remove_archive(const path *p)
+{
+    boost::system::error_code ec;
+    log_printf("removing cached archive %s\n", p->c_str());
+    remove(*p, ec);
+    delete p;
+}
+
+archive_cache::handle archive_cache::get(const path& directory_path, bool build,
+                                         content_digest *digest)
+{
+    uint64_t key = fingerprint(directory_path);
+
+    unique_lock<mutex> guard(lock);
+    entry_map::iterator iter;
+    while ((iter = entries.find(key)) != entries.end() && iter->second->building)
+        built.wait(guard);
+
+    // reuse the finished archive, unless somebody deleted it
+    if (iter != entries.end())
+    {
+        if (exists(*iter->second->archive))
+        {
+            log_printf("using cached archive %s\n", iter->second->archive->c_str());
+            iter->second->last_used = time(NULL);
+            if (digest)
+                *digest = iter->second->digest;
+            return iter->second->archive;
+        }
+        total_bytes -= iter->second->size;
+        entries.erase(iter);
+    }
+    if (!build)
+        return handle();
+
+    // build it ourselves, others wait for it
+    shared_ptr<entry> e(new entry);
+    e->directory = directory_path;
+    e->building = true;
+    e->size = 0;
+    entries[key] = e;
+    guard.unlock();
+
+    char name[64];
+    sprintf(name, "easytransfer-%016llx%s", (unsigned long long)key, codec->extension);
+    path archive = temp_directory_path() / name;
+    path partial = archive;
+    partial += ".part";
+
+    boost::system::error_code ec;
+    content_digest archive_digest;
+    bool ok = compress_directory(directory_path, partial,
+                                 compute_digests ? &archive_digest : NULL);
+    if (ok)
+        rename(partial, archive, ec);
+    if (!ok || ec)
+    {
+        remove(partial, ec);
+        guard.lock();
+        entries.erase(key);
+        built.notify_all();
+        return handle();
+    }
+
+    guard.lock();
+    e->archive = handle(new path(archive), remove_archive);
+    e->size = file_size(archive, ec);
+    e->last_used = time(NULL);
+    e->building = false;
+    if (archive_digest.known)
+    {
+        e->digest = archive_digest;
+        e->digest.size = e->size;
+        e->digest.mtime = last_write_time(archive, ec);
+    }
+    if (digest)
+        *digest = e->digest;
+    total_bytes += e->size;
+    built.notify_all();
+    evict(key);
+    return e->archive;
+}
+
+// drop archives of older versions of the same directories, then the least
+// recently used ones until the cache fits. must be called with lock held.
+void archive_cache::evict(uint64_t keep)
+{
+    const path& directory = entries[keep]->directory;
+    for (entry_map::iterator iter = entries.begin(); iter != entries.end(); )
+    {
+        if (iter->first != keep && !iter->second->building &&
+            iter->second->directory == directory)
+        {
+            total_bytes -= iter->second->size;
+            entries.erase(iter++);
+        }
+        else
+            ++iter;
+    }
+
+    while (total_bytes > max_bytes)
+    {
+        entry_map::iterator oldest = entries.end();
+        for (entry_map::iterator iter = entries.begin(); iter != entries.end(); ++iter)
+        {
+            if (iter->first != keep && !iter->second->building &&
+                (oldest == entries.end() ||
+                 iter->second->last_used < oldest->second->last_used))
+                oldest = iter;
+        }
+        if (oldest == entries.end())
+            break;
+        total_bytes -= oldest->second->size;
+        entries.erase(oldest);
+    }
+}
+
+void archive_cache::clear()
+{
+    lock_guard<mutex> guard(lock);
+    for (entry_map::iterator iter = entries.begin(); iter != entries.end(); )
+    {
+        if (iter->second->building)
+            ++iter;
+        else
+            entries.erase(iter++);
+    }
+    total_bytes = 0;
+}
+
+
+// compress a directory straight into the connection, so that compression
+// and transmission overlap and nothing is written to disk. the socket send
+// buffer drains while the next block is being compressed, and memory use
+// is bounded by the compressor's blocks in flight.
+// assumes that directory_path is valid
+void stream_directory(mg_connection *conn,
+                      const mg_request_info *request,
+                      const path& directory_path,
+                      const path& filename)
+{
+    log_printf("streaming directory \"%s\"\n", directory_path.c_str());
+
+    // chunked encoding is HTTP/1.1 only, older clients read until close
+    http_output output = { conn, strcmp(request->http_version, "1.0") != 0 };
+
+    char encoded_filename[256];
+    mg_url_encode(to_utf8(filename.c_str()), encoded_filename, sizeof(encoded_filename));
+    mg_printf(conn, "HTTP/1.1 200 OK\r\n"
+              "Content-Type: %s\r\n"
+              "Content-disposition: attachment; filename*=UTF-8''%s\r\n"
+              "%s"
+              "Connection: close\r\n\r\n",
+              codec->mime_type, encoded_filename,
+              output.chunked ? "Transfer-Encoding: chunked\r\n" : "");
+
+    // only terminate the body if it's complete, so a truncated archive
+    // shows up as an error on the other end
+    if (write_archive(directory_path, output) && output.chunked)
+        mg_write(conn, "0\r\n\r\n", 5);
+}
+
+
+// handle GET requests
+// the name a share is downloaded as, a directory's is its archive's
+path download_name(const path& p)
+{
+    path filename = p.filename();
+    if (is_directory(p))
+    {
+        std::string name = filename.string();
+        if (name[0] == '.')
+            name.erase(0, 1);
+        filename = name + codec->extension;
+    }
+    return filename;
+}
+
+// headers carrying a digest, RFC 9530's and the older RFC 3230 one
+std::string digest_headers(const content_digest& digest)
+{
+    std::string base64 = digest.base64();
+    return "Repr-Digest: sha-256=:" + base64 + ":\r\n"
+        "Digest: SHA-256=" + base64 + "\r\n";
+}
+
+// the digest of a share in sha256sum's format, served at /<uuid>.sha256.
+// asking for it doesn't count as a download.
+void handle_digest(mg_connection *conn, uint64_t uuid)
+{
+    share s;
+    content_digest digest;
+    std::string status = "200 OK", headers, body;
+    if (!shares.find(uuid, s) || check_path(s.shared_path).length())
+    {
+        status = "404 Not Found";
+        body = "no such share\n";
+    }
+    else if (!s.digest && stream_archives)
+    {
+        status = "404 Not Found";
+        body = "directories are streamed, their archives have no digest\n";
+    }
+    else
+    {
+        if (s.digest && !digests.get(s.digest, digest))
+            digests.hurry(s.digest);
+        else if (!s.digest)
+            archives.get(s.shared_path, false, &digest);
+
+        if (digest.known)
+            body = digest.hex() + "  " + download_name(s.shared_path).string() + "\n";
+        else
+        {
+            status = "503 Service Unavailable";
+            headers = "Retry-After: 10\r\n";
+            body = s.digest ? "the digest is being computed\n" :
+                "the digest is known once the archive is built by the first download\n";
+        }
+    }
+
+    log_printf("digest of %llu: %s", (unsigned long long)uuid, body.c_str());
+    mg_printf(conn, "HTTP/1.1 %s\r\n"
+              "%s"
+              "Content-Type: text/plain\r\n"
+              "Content-Length: %u\r\n\r\n%s",
+              status.c_str(), headers.c_str(), (unsigned int)body.length(), body.c_str());
+}
+
+void handle_get(mg_connection *conn,
+                const mg_request_info *request)
+{
+    std::string response_status;
+    uint64_t uuid = 0;
+
+    // "/<uuid>.sha256" asks for the digest of the share
+    std::string name = request->uri + 1;
+    bool digest_request = name.length() > 7 && name.compare(name.length() - 7, 7, ".sha256") == 0;
+    if (digest_request)
+        name.erase(name.length() - 7);
+    try
+    {
+        uuid = !name.empty() && isdigit(name[0]) ? lexical_cast<uint64_t>(name) : 0;
+    }
+    catch (bad_lexical_cast ex)
+    { }
+    log_printf("uuid requested: %s\n", request->uri + 1);
+    if (digest_request)
+    {
+        handle_digest(conn, uuid);
+        return;
+    }
+
+    // make sure the uuid exists
+    share_table::share_ptr s = shares.acquire(uuid);
+    if (!s)
+    {
+        log_printf("uuid not correct\n");
+        response_status = "404 Not Found";
+    }
+    else
+    {
+        const path& p = s->shared_path;
+        
+        // check to see if the path is still valid
+        response_status = check_path(p);
+        if (response_status.length())
+            shares.remove(uuid);
+        else
+        {
+            // if it's a directory, send its archive
+            archive_cache::handle archive;
+            content_digest digest;
+            path filename = download_name(p);
+            if (is_directory(p))
+            {
+                // stream it, unless it's in the cache already
+                archive = archives.get(p, !stream_archives, &digest);
+                if (!archive && stream_archives)
+                {
+                    stream_directory(conn, request, p, filename);
+                    log_printf("finished streaming the directory.\n");
+                    return;
+                }
+            }
 
-    // get external ip, and quit if that failed
-    std::string external_ip = get_external_ip();
-    if (external_ip.length() == 0)
+            // send the file
+            if (is_directory(p) && !archive)
+                response_status = "500 Internal Server Error";
+            else
+            {
+                // a file's digest may still be on its way, then a full
+                // download hurries it along
+                if (s->digest && !digests.get(s->digest, digest) &&
+                    !mg_get_header(conn, "Range"))
+                    digests.hurry(s->digest);
+
+                // a file's headers are prepared already, an archive only
+                // needs them to carry its digest
+                shared_ptr<mg_file_headers> headers;
+                if (!archive)
+                    headers = s->headers;
+                else if (digest.known)
+                    headers.reset(mg_prepare_file_headers(ctx, to_utf8(archive->c_str()),
+                                                          to_utf8(filename.c_str())),
+                                  mg_free_file_headers);
+                if (headers)
+                    mg_send_prepared_file(conn, headers.get(),
+                                          digest.known ? digest_headers(digest).c_str() : NULL);
+                else
+                    mg_send_file(conn, to_utf8(archive ? archive->c_str() : p.c_str()),
+                                 to_utf8(filename.c_str()));
+                log_printf("finished sending the file.\n");
+                return;
+            }
+        }
+    }
+
+    log_printf("responded with %s\n", response_status.c_str());
+    mg_printf(conn, "HTTP/1.1 %s\r\n"
+              "Content-Type: text/plain\r\n\r\n",
+              response_status.c_str());
+}
+
+
+// control API, served on the daemon's unix socket only:
+//   POST /shares           path=...&count=...&duration=...  adds a share
+//   GET /shares                                             lists them
+//   PUT /shares/<uuid>     count=...&duration=...           re-budgets one
+//   DELETE /shares/<uuid>                                   revokes one
+// request bodies are url-encoded forms, durations are in seconds.
+void send_control_response(mg_connection *conn, const char *status,
+                           const std::string& body)
+{
+    mg_printf(conn, "HTTP/1.1 %s\r\n"
+              "Content-Type: text/plain\r\n"
+              "Content-Length: %u\r\n"
+              "Connection: close\r\n\r\n",
+              status, (unsigned int)body.length());
+    mg_write(conn, body.data(), body.length());
+}
+
+void handle_control(mg_connection *conn,
+                    const mg_request_info *request)
+{
+    std::string body;
+    char buffer[4096];
+    int n;
+    while ((n = mg_read(conn, buffer, sizeof(buffer))) > 0)
+        body.append(buffer, n);
+
+    // form fields, empty if missing
+    char value[4096];
+    std::string path_var, count_var, duration_var;
+    if (mg_get_var(body.data(), body.length(), "path", value, sizeof(value)) > 0)
+        path_var = value;
+    if (mg_get_var(body.data(), body.length(), "count", value, sizeof(value)) > 0)
+        count_var = value;
+    if (mg_get_var(body.data(), body.length(), "duration", value, sizeof(value)) > 0)
+        duration_var = value;
+
+    // the links are only known once the external ip is, until then a
+    // client waits for the daemon to finish starting
+    std::string prefix;
     {
-        log_printf("failed to get external ip\n");
+        lock_guard<mutex> guard(link_lock);
+        prefix = link_prefix;
+    }
+    if (prefix.empty())
+    {
+        send_control_response(conn, "503 Service Unavailable", "starting up\n");
+        return;
+    }
+
+    const char *method = request->request_method;
+    std::string uri = request->uri;
+    uint64_t uuid = 0;
+    int count = -1;
+    long duration = -1;
+    try
+    {
+        if (uri.compare(0, 8, "/shares/") == 0)
+            uuid = lexical_cast<uint64_t>(uri.substr(8));
+        if (count_var.length())
+            count = lexical_cast<int>(count_var);
+        if (duration_var.length())
+            duration = lexical_cast<long>(duration_var);
+    }
+    catch (bad_lexical_cast&)
+    {
+        send_control_response(conn, "400 Bad Request", "bad number\n");
+        return;
+    }
+
+    if (uri == "/shares" && !strcmp(method, "POST"))
+    {
+        std::string status = path_var.length() ? check_path(path_var) : "400 Bad Request";
+        if (status.length())
+        {
+            send_control_response(conn, status.c_str(), path_var + ": " + status + "\n");
+            return;
+        }
+        uuid = shares.add(path_var, count < 0 ? 2 : count, duration < 0 ? 30 * 60 : duration);
+        if (uuid == 0)
+        {
+            // the daemon is on its way out, the client starts a new one
+            send_control_response(conn, "503 Service Unavailable", "shutting down\n");
+            return;
+        }
+        log_printf("shared %s as %llu\n", path_var.c_str(), (unsigned long long)uuid);
+        send_control_response(conn, "201 Created", prefix + lexical_cast<std::string>(uuid) + "\n");
+    }
+    else if (uri == "/shares" && !strcmp(method, "GET"))
+    {
+        std::vector<share> list = shares.list();
+        time_t now = time(NULL);
+        std::string response;
+        for (size_t i = 0; i < list.size(); ++i)
+        {
+            char line[128];
+            sprintf(line, "%llu\t%d\t%ld\t", (unsigned long long)list[i].uuid,
+                    list[i].downloads_left, (long)(list[i].expiration_time - now));
+            response += line + prefix + lexical_cast<std::string>(list[i].uuid) +
+                '\t' + list[i].shared_path.string() + '\n';
+        }
+        send_control_response(conn, "200 OK", response);
+    }
+    else if (uuid != 0 && !strcmp(method, "PUT"))
+    {
+        if (shares.update(uuid, count, duration))
+            send_control_response(conn, "200 OK", "");
+        else
+            send_control_response(conn, "404 Not Found", "no such share\n");
+    }
+    else if (uuid != 0 && !strcmp(method, "DELETE"))
+    {
+        if (shares.remove(uuid))
+            send_control_response(conn, "200 OK", "");
+        else
+            send_control_response(conn, "404 Not Found", "no such share\n");
+    }
+    else
+        send_control_response(conn, "405 Method Not Allowed", "");
+}
+
+
+// HTTP callback
+// appends one sample in the Prometheus text format, with the HELP and
+// TYPE lines if help is given
+void add_metric(std::string& out, const char *name, const char *type,
+                const char *help, const std::string& labels, uintmax_t value)
+{
+    if (help)
+        out = out + "# HELP " + name + ' ' + help + "\n# TYPE " + name + ' ' + type + '\n';
+    out = out + name + (labels.length() ? '{' + labels + '}' : "") + ' ' +
+        lexical_cast<std::string>(value) + '\n';
+}
+
+// a label value, with quotes, backslashes and newlines escaped
+std::string metric_label(const char *name, const std::string& value)
+{
+    std::string escaped;
+    for (size_t i = 0; i < value.length(); ++i)
+    {
+        if (value[i] == '\\' || value[i] == '"')
+            escaped += '\\';
+        escaped += value[i] == '\n' ? std::string("\\n") : std::string(1, value[i]);
+    }
+    return std::string(name) + "=\"" + escaped + '"';
+}
+
+// GET /metrics, for the control socket and loopback connections only
+void handle_metrics(mg_connection *conn)
+{
+    mg_server_stats server;
+    mg_pool_stats pool;
+    mg_get_server_stats(ctx, &server);
+    mg_get_pool_stats(ctx, &pool);
+
+    std::string out;
+    add_metric(out, "easytransfer_sent_bytes_total", "counter",
+               "Bytes sent to clients.", "", server.bytes_sent);
+    add_metric(out, "easytransfer_requests_total", "counter",
+               "HTTP requests served.", "", server.requests);
+    add_metric(out, "easytransfer_active_connections", "gauge",
+               "Connections being served, offloaded sends included.", "",
+               server.active_connections);
+    add_metric(out, "easytransfer_offloaded_transfers", "gauge",
+               "File sends in flight on the epoll reactor.", "", pool.num_transfers);
+    add_metric(out, "easytransfer_socket_queue_depth", "gauge",
+               "Accepted connections waiting for a worker.", "", pool.queue_depth);
+    add_metric(out, "easytransfer_socket_queue_capacity", "gauge",
+               "Size of the accepted connections queue.", "", pool.queue_size);
+    add_metric(out, "easytransfer_workers", "gauge",
+               "Worker threads by state.", "state=\"busy\"",
+               pool.num_threads - pool.idle_threads);
+    add_metric(out, "easytransfer_workers", "gauge", NULL, "state=\"idle\"",
+               pool.idle_threads);
+    add_metric(out, "easytransfer_workers_max", "gauge",
+               "Upper bound of the worker pool.", "", pool.max_threads);
+
+    uintmax_t bytes_in, bytes_out;
+    size_t in_progress;
+    compression.get(bytes_in, bytes_out, in_progress);
+    add_metric(out, "easytransfer_archives_in_progress", "gauge",
+               "Directory archives being built.", "", in_progress);
+    add_metric(out, "easytransfer_archive_read_bytes_total", "counter",
+               "Bytes of shared files read into archives.", "", bytes_in);
+    add_metric(out, "easytransfer_archive_written_bytes_total", "counter",
+               "Compressed archive bytes produced.", "", bytes_out);
+
+    std::vector<share> list = shares.list();
+    time_t now = time(NULL);
+    for (size_t i = 0; i < list.size(); ++i)
+    {
+        std::string labels = metric_label("uuid", lexical_cast<std::string>(list[i].uuid)) +
+            ',' + metric_label("path", to_utf8(list[i].shared_path.c_str()));
+        add_metric(out, "easytransfer_share_downloads_remaining", "gauge",
+                   i == 0 ? "Downloads left before a share is revoked." : NULL,
+                   labels, list[i].downloads_left);
+    }
+    for (size_t i = 0; i < list.size(); ++i)
+    {
+        std::string labels = metric_label("uuid", lexical_cast<std::string>(list[i].uuid));
+        add_metric(out, "easytransfer_share_expiry_seconds", "gauge",
+                   i == 0 ? "Seconds left before a share expires." : NULL, labels,
+                   list[i].expiration_time > now ? list[i].expiration_time - now : 0);
+    }
+
+    mg_printf(conn, "HTTP/1.1 200 OK\r\n"
+              "Content-Type: text/plain; version=0.0.4\r\n"
+              "Content-Length: %u\r\n"
+              "Connection: close\r\n\r\n",
+              (unsigned int)out.length());
+    mg_write(conn, out.data(), out.length());
+}
+
+void *callback(mg_event event,
+               mg_connection *conn,
+               const mg_request_info *request)
+{
+    if (event != MG_NEW_REQUEST)
+        return (void*)1;
+
+    log_printf("new request: =====================\n"
+               "method: %s\n"
+               "uri: %s\n"
+               "ip: %lx\n",
+               request->request_method,
+               request->uri,
+               request->remote_ip);
+    for (int i = 0; i < request->num_headers; ++i)
+        log_printf("%s - %s\n", request->http_headers[i]);
+
+    if (!strcmp(request->uri, "/metrics") &&
+        (request->is_local || request->remote_ip == 0x7f000001))
+        handle_metrics(conn);
+    else if (request->is_local)
+        handle_control(conn, request);
+    else if (!strcmp(request->request_method, "GET"))
+        handle_get(conn, request);
+
+    log_printf("\n");
+
+    return (void*)1;
+}
+
+
+
+#ifndef _WIN32
+// the control socket is private to the user: it lives in the user's runtime
+// directory, or else in a directory of their own in /tmp that nobody else
+// can enter. returns an empty path if that directory can't be trusted, the
+// paths are then shared by a new server every time.
+path default_control_path()
+{
+    const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+    path dir = runtime_dir && *runtime_dir ? path(runtime_dir) :
+        temp_directory_path() / ("easytransfer-" + lexical_cast<std::string>(getuid()));
+    if (!runtime_dir || !*runtime_dir)
+        mkdir(dir.c_str(), 0700);   // fails if it exists, checked below
+
+    // someone else's directory, a symlink to one, or one that others can
+    // write to could let them take the socket's place
+    struct stat st;
+    if (lstat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode) ||
+        st.st_uid != getuid() || (st.st_mode & 077) != 0)
+    {
+        log_printf("not using a control socket, %s is not private\n", dir.c_str());
+        return path();
+    }
+    return dir / "easytransfer.sock";
+}
+
+std::string url_encode(const std::string& str)
+{
+    std::vector<char> encoded(str.length() * 3 + 1);
+    mg_url_encode(str.c_str(), &encoded[0], encoded.size());
+    return &encoded[0];
+}
+
+// send a request to the control socket of a running daemon, and read the
+// response body. returns the HTTP status, or 0 if no daemon is listening.
+int control_request(const std::string& method, const std::string& uri,
+                    const std::string& body, std::string& response)
+{
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (control_path.empty() || control_path.native().length() >= sizeof(addr.sun_path))
+        return 0;
+    strcpy(addr.sun_path, control_path.c_str());
+
+    // the paths only go to a daemon of the same user: the socket has to be
+    // the user's own and closed to others
+    struct stat st;
+    if (lstat(control_path.c_str(), &st) != 0 || !S_ISSOCK(st.st_mode) ||
+        st.st_uid != getuid() || (st.st_mode & 077) != 0)
+        return 0;
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0)
+        return 0;
+    if (connect(sock, (sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        close(sock);
+        return 0;
+    }
+
+    // and so has the process behind it, the socket could have been replaced
+    // since the check
+    uid_t peer_uid;
+#ifdef SO_PEERCRED
+    struct ucred cred;
+    socklen_t cred_length = sizeof(cred);
+    peer_uid = getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &cred_length) == 0 ? cred.uid : (uid_t)-1;
+#else
+    gid_t peer_gid;
+    if (getpeereid(sock, &peer_uid, &peer_gid) != 0)
+        peer_uid = (uid_t)-1;
+#endif
+    if (peer_uid != getuid())
+    {
+        log_printf("ignoring control socket %s of another user\n", control_path.c_str());
+        close(sock);
+        return 0;
+    }
+
+    std::string request = method + ' ' + uri + " HTTP/1.0\r\n"
+        "Content-Type: application/x-www-form-urlencoded\r\n"
+        "Content-Length: " + lexical_cast<std::string>(body.length()) + "\r\n\r\n" + body;
+    for (size_t sent = 0; sent < request.length(); )
+    {
+        ssize_t n = send(sock, request.data() + sent, request.length() - sent, 0);
+        if (n <= 0)
+        {
+            close(sock);
+            return 0;
+        }
+        sent += n;
+    }
+
+    // the daemon closes the connection after the response
+    std::string answer;
+    char buffer[4096];
+    ssize_t n;
+    while ((n = recv(sock, buffer, sizeof(buffer), 0)) > 0)
+        answer.append(buffer, n);
+    close(sock);
+
+    int status = 0;
+    size_t pos = answer.find("\r\n\r\n");
+    if (sscanf(answer.c_str(), "HTTP/%*s %d", &status) != 1 || pos == std::string::npos)
+        return 0;
+    response = answer.substr(pos + 4);
+    return status;
+}
+
+// hand the paths over to a running daemon, one round trip each, and print
+// the links to output. returns false if there's no daemon to take them.
+bool add_to_daemon(const std::vector<std::string>& paths, int count,
+                   unsigned int duration, FILE *output, int& exit_code)
+{
+    exit_code = EXIT_SUCCESS;
+    for (size_t i = 0; i < paths.size(); ++i)
+    {
+        std::string body = "path=" + url_encode(absolute(paths[i]).string()) +
+            "&count=" + lexical_cast<std::string>(count) +
+            "&duration=" + lexical_cast<std::string>(duration);
+        std::string response;
+        int status = control_request("POST", "/shares", body, response);
+
+        // a daemon that is quitting answers 503 until it's gone, one that
+        // is starting until it knows the external ip
+        for (int tries = 0; status == 503 && tries < 150; ++tries)
+        {
+            usleep(100 * 1000);
+            status = control_request("POST", "/shares", body, response);
+        }
+        if (status == 0 && i == 0)
+            return false;
+
+        fputs(response.c_str(), output);
+        if (status / 100 != 2)
+            exit_code = EXIT_FAILURE;
+    }
+    fflush(output);
+    return true;
+}
+
+// --list, --revoke and --update talk to the running daemon only
+int control_command(const variables_map& vm)
+{
+    std::string response;
+    int status;
+    if (vm.count("list"))
+        status = control_request("GET", "/shares", "", response);
+    else if (vm.count("revoke"))
+        status = control_request("DELETE", "/shares/" + lexical_cast<std::string>(vm["revoke"].as<uint64_t>()),
+                                 "", response);
+    else
+    {
+        std::string body;
+        if (!vm["count"].defaulted())
+            body = "count=" + lexical_cast<std::string>(vm["count"].as<int>());
+        if (!vm["duration"].defaulted())
+            body += std::string(body.empty() ? "" : "&") + "duration=" +
+                lexical_cast<std::string>(vm["duration"].as<unsigned int>() * 60);
+        status = control_request("PUT", "/shares/" + lexical_cast<std::string>(vm["update"].as<uint64_t>()),
+                                 body, response);
+    }
+
+    if (status == 0)
+    {
+        std::cout << "easytransfer is not running\n";
+        return EXIT_FAILURE;
+    }
+    std::cout << response;
+    return status / 100 == 2 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+#endif
+
+
+// main, left out when the benchmarks build this file into theirs
+#ifndef EASYTRANSFER_NO_MAIN
+#if defined(_WIN32) && defined(NDEBUG)
+int APIENTRY WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, 
+                     LPSTR lpCmdLine, int nCmdShow)
+{
+    int argc = __argc;
+    char **argv = __argv;
+#else
+int main(int argc, char *argv[])
+{
+#endif
+    // parse the commandline arguments
+    options_description desc("Usage: easytransfer [options] path...\nAllowed options");
+    desc.add_options()
+        ("path", value<std::vector<std::string> >(), "paths of the files/folders, each gets its own link (required, can also the last arguments)")
+        ("count,c", value<int>()->default_value(2), "maximum download count before a link expires")
+        ("duration,d", value<unsigned int>()->default_value(30), "time before a link expires, in minutes")
+        ("stream,s", "stream directories while compressing them, instead of compressing to a temporary file first")
+        ("cache-size", value<unsigned int>()->default_value(1024), "disk space for cached directory archives, in MB")
+        ("codec", value<std::string>()->default_value("auto"), "compression for directories: auto, gzip, zstd, lz4 or store. "
+            "auto is gzip that stores incompressible data as is")
+        ("threads,j", value<unsigned int>()->default_value(std::max(thread::hardware_concurrency(), 1u)), "number of threads compressing directories")
+        ("io-chunk", value<unsigned int>()->default_value(256), "size of the reads from shared files, in KB")
+        ("io-threads", value<unsigned int>()->default_value(4), "threads walking directories and reading their files ahead of the compression")
+        ("io-uring", "send files through io_uring when the kernel supports it")
+        ("no-digest", "don't compute the sha-256 of the shares")
+        ("network-ttl", value<unsigned int>()->default_value(24 * 60), "minutes to trust the cached router and external ip, 0 disables the cache")
+#ifndef _WIN32
+        ("control", value<std::string>(), "control socket of the daemon, default: $XDG_RUNTIME_DIR/easytransfer.sock, "
+            "or /tmp/easytransfer-<uid>/easytransfer.sock. paths given while a daemon is running are shared through it")
+        ("list,l", "list the shares of the running daemon")
+        ("revoke", value<uint64_t>(), "revoke a share of the running daemon")
+        ("update", value<uint64_t>(), "set a new download count and/or duration for a share of the running daemon")
+#endif
+        ("verbose,v", "turn on verbose mode")
+        ("help,h", "produce this help message")
+        ;
+    positional_options_description pos_desc;
+    pos_desc.add("path", -1);
+    parsed_options parsed = command_line_parser(argc, argv).options(desc).positional(pos_desc).run();
+    variables_map vm;
+    store(parsed, vm);
+    notify(vm);
+
+    if (vm.count("help"))
+    {
+        std::cout << desc << '\n';
+        return 0;
+    }
+    verbose = vm.count("verbose") > 0;
+#ifndef _WIN32
+    control_path = vm.count("control") ? path(vm["control"].as<std::string>()) : default_control_path();
+    if (vm.count("list") || vm.count("revoke") || vm.count("update"))
+        return control_command(vm);
+#endif
+    if (!vm.count("path"))
+    {
+        std::cout << desc << '\n';
+        return EXIT_FAILURE;
+    }
+    std::vector<std::string> paths = vm["path"].as<std::vector<std::string> >();
+    int count = vm["count"].as<int>();
+    unsigned int duration = vm["duration"].as<unsigned int>() * 60; // * 60 to get seconds
+    stream_archives = vm.count("stream") > 0;
+    compute_digests = vm.count("no-digest") == 0;
+    compress_threads = vm["threads"].as<unsigned int>();
+    network_ttl = vm["network-ttl"].as<unsigned int>() * 60;
+    io_chunk_size = size_t(std::min(std::max(vm["io-chunk"].as<unsigned int>(), 8u), 65536u)) * 1024;
+    io_threads = std::min(std::max(vm["io-threads"].as<unsigned int>(), 1u), 64u);
+    archives.max_bytes = uintmax_t(vm["cache-size"].as<unsigned int>()) * 1024 * 1024;
+    std::string codec_name = vm["codec"].as<std::string>();
+    for (codec = codecs; codec != codecs + sizeof(codecs) / sizeof(codecs[0]); ++codec)
+        if (codec_name == codec->name)
+            break;
+    if (codec == codecs + sizeof(codecs) / sizeof(codecs[0]))
+    {
+        std::cout << "unknown codec: " << codec_name << '\n';
         return EXIT_FAILURE;
     }
+    
+
+    // check the paths first
+    for (size_t i = 0; i < paths.size(); ++i)
+    {
+        log_printf("checking path: %s\n", paths[i].c_str());
+        std::string path_status = check_path(paths[i]);
+        if (path_status.length() > 0)
+        {
+            std::cout << paths[i] << ": " << path_status << '\n';
+            return EXIT_FAILURE;
+        }
+    }
+
+    // if a daemon is running already, it only takes a round trip on the
+    // control socket to share the paths
+#ifndef _WIN32
+    int exit_code;
+    if (add_to_daemon(paths, count, duration, stdout, exit_code))
+        return exit_code;
+#endif
 
-    // create the UUID, and hence, the full link, and print it
-    the_uuid = uniform_int<uint64_t>(0x100000000, 0x4000000000000000)(rng);
-    port = lexical_cast<std::string>(port_gen(rng));
-    std::cout << "http://" << external_ip << ':' << port << '/' << the_uuid << '\n';
 
-    // fork off as daemon
+    // call WSAStartup on windows
+#ifdef _WIN32
+    WSADATA wsa_data;
+    int wsa_result = WSAStartup(MAKEWORD(2, 2), &wsa_data);
+    if (wsa_result != NO_ERROR)
+    {
+        log_printf("WSAStartup() failed: %d\n", wsa_result);
+        return EXIT_FAILURE;
+    }
+#endif
+
+    // fork off as daemon first, threads don't survive a fork. the parent
+    // only prints what the daemon sends down the pipe, the links or why
+    // there are none.
+    posix_time::ptime startup = posix_time::microsec_clock::universal_time();
+    FILE *output = stdout;
 #ifndef _WIN32
     if (!verbose)
     {
+        int link_pipe[2];
+        if (pipe(link_pipe) != 0)
+            return EXIT_FAILURE;
         pid_t pid = fork();
         // fork off parent process
         if (pid < 0)
             return EXIT_FAILURE;
         else if (pid > 0)
-            return EXIT_SUCCESS;
+        {
+            close(link_pipe[1]);
+            std::string links;
+            char buffer[1024];
+            ssize_t n;
+            while ((n = read(link_pipe[0], buffer, sizeof(buffer))) > 0)
+                links.append(buffer, n);
+            std::cout << links;
+            return links.compare(0, 7, "http://") == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+        close(link_pipe[0]);
+        output = fdopen(link_pipe[1], "w");
         
         umask(0); // change the file mode mask
         
@@ -557,44 +3058,118 @@ int main(int argc, char *argv[])
         close(STDOUT_FILENO);
         close(STDERR_FILENO);
     }
+
+    // the signals go to a thread of their own, so block them before any
+    // other thread starts and inherits the mask
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGQUIT);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    thread(wait_for_signals, signals).detach();
 #endif
 
-    // try to do UPnP discovery
-    use_upnp = upnp_discovery();
-    
-    // start the server
-    log_printf("Starting server on port %s...", port.c_str());
-    const char* options[] =
+    // look up the external ip while the server starts, unless the cached
+    // one is still good
+    startup_phase<network_info> cache_check("network cache check", check_network_cache);
+    startup_phase<std::string> ip_lookup("external ip lookup", bind(lookup_external_ip, cache_check));
+
+    // start the server, on another port if that one is taken
+    std::string io_buffer_size = lexical_cast<std::string>(io_chunk_size);
+    for (int tries = 0; !ctx && tries < 5; ++tries)
     {
-        "listening_ports", port.c_str(),
-        "enable_directory_listing", "no",
-        NULL
-    };
-    ctx = mg_start(callback, NULL, options);
+        port = lexical_cast<std::string>(port_gen(rng));
+        log_printf("Starting server on port %s...", port.c_str());
+        std::string listening_ports = port;
+#ifndef _WIN32
+        if (!control_path.empty())
+            listening_ports += ",unix:" + control_path.string();
+#endif
+        const char* options[] =
+        {
+            "listening_ports", listening_ports.c_str(),
+            "enable_directory_listing", "no",
+            "enable_epoll", "yes",
+            "io_buffer_size", io_buffer_size.c_str(),
+            "enable_io_uring", vm.count("io-uring") ? "yes" : "no",
+            "extra_mime_types", ".zst=application/zstd,.lz4=application/x-lz4",
+            NULL
+        };
+        ctx = mg_start(callback, NULL, options);
+        log_printf(ctx ? "succeded.\n" : "failed.\n");
+#ifndef _WIN32
+        // another instance started at the same time and got the control
+        // socket first, it takes the paths then
+        if (!ctx && add_to_daemon(paths, count, duration, output, exit_code))
+        {
+            if (output != stdout)
+                fclose(output);
+            return exit_code;
+        }
+#endif
+    }
     if (!ctx)
-        raise(SIGTERM);
+    {
+        fprintf(output, "failed to start the server\n");
+        return EXIT_FAILURE;
+    }
+    log_printf("server start: %ld ms\n", elapsed_ms(startup));
+
+    // the port is fixed now, map it in the background
+    startup_phase<bool> port_mapping("UPnP port mapping", bind(map_port, cache_check));
+
+    // create the shares, and hence, the full links, and print them as soon
+    // as the address is known
+    std::string external_ip;
+    if (!ip_lookup.wait(ip_lookup_deadline, external_ip) || external_ip.length() == 0)
+    {
+        log_printf("failed to get external ip\n");
+        fprintf(output, "failed to get external ip\n");
+        mg_stop(ctx);
+        return EXIT_FAILURE;
+    }
+    {
+        lock_guard<mutex> guard(link_lock);
+        link_prefix = "http://" + external_ip + ':' + port + '/';
+    }
+    for (size_t i = 0; i < paths.size(); ++i)
+    {
+        uint64_t uuid = shares.add(absolute(paths[i]), count, duration);
+        fprintf(output, "%s%llu\n", link_prefix.c_str(), (unsigned long long)uuid);
+    }
+    if (output != stdout)
+        fclose(output);
     else
-        log_printf("succeded.\n");
+        fflush(output);
+    log_printf("time to link: %ld ms\n", elapsed_ms(startup));
 
+#ifdef _WIN32
     // setup the signal handlers
     signal(SIGINT, sig_hand);
     signal(SIGTERM, sig_hand);
-#ifdef SIGQUIT
-    signal(SIGQUIT, sig_hand);
-#endif
 #ifdef SIGBREAK
     signal(SIGBREAK, sig_hand);
+#endif
 #endif
 
-    // go to sleep for a very long time (want a better way for this)
     log_printf("Press CTRL-C to quit.\n");
-#ifdef _WIN32
-    Sleep(duration * 1000);
-#else
-    sleep(duration);
-#endif
+    // serve until every share has expired or run out of downloads, then
+    // let the downloads in flight finish before the port mapping goes.
+    // a signal cuts this short.
+    if (shares.wait_until_empty())
+    {
+        log_printf("no shares left, waiting for the downloads to finish\n");
+        if (shares.wait_for_downloads())
+            mg_wait_for_transfers(ctx);
+    }
 
-    raise(SIGTERM);
+    log_printf("quitting...\n");
+    mg_stop(ctx);
+    archives.clear();
+    if (use_upnp)
+        remove_upnp_mapping();
     
-    return 0;
+    return EXIT_SUCCESS;
 }
+#endif // EASYTRANSFER_NO_MAIN
@@ -24,6 +24,9 @@
 #define _XOPEN_SOURCE 600 // For flockfile() on Linux
 #define _LARGEFILE_SOURCE // Enable 64-bit file offsets
 #define __STDC_FORMAT_MACROS // <inttypes.h> wants this for C++
+#if defined(__linux__)
+#define _DEFAULT_SOURCE // For syscall() on Linux
+#endif
 #endif
 
 #if defined(__SYMBIAN32__)
@@ -170,6 +173,7 @@ typedef struct DIR {
 #include <sys/wait.h>
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
@@ -184,6 +188,28 @@ typedef struct DIR {
 #include <dlfcn.h>
 #endif
 #include <pthread.h>
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#define USE_FUTEX
+#endif
+#if defined(__linux__) && !defined(NO_SENDFILE)
+#include <sys/sendfile.h>
+#define USE_SENDFILE
+#endif
+#if defined(__linux__) && !defined(NO_EPOLL)
+#include <sys/epoll.h>
+#define USE_EPOLL
+#endif
+#if defined(__linux__) && !defined(NO_IO_URING)
+#include <linux/version.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#define USE_IO_URING
+#endif
+#endif
 #if defined(__MACH__)
 #define SSL_LIB   "libssl.dylib"
 #define CRYPTO_LIB  "libcrypto.dylib"
@@ -213,6 +239,15 @@ typedef int SOCKET;
 
 #endif // End of Windows and UNIX specific includes
 
+// The request parser scans with SSE2, or AVX2 if the CPU has it.
+#if !defined(NO_SIMD) && defined(__GNUC__) && defined(__SSE2__)
+#include <immintrin.h>
+#define USE_SSE2
+#if defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)
+#define USE_AVX2
+#endif
+#endif // !NO_SIMD
+
 #include "mongoose.h"
 
 #define MONGOOSE_VERSION "3.1"
@@ -371,6 +406,9 @@ struct usa {
   union {
     struct sockaddr sa;
     struct sockaddr_in sin;
+#if !defined(_WIN32)
+    struct sockaddr_un un;
+#endif // !_WIN32
   } u;
 };
 
@@ -380,6 +418,26 @@ struct vec {
   size_t len;
 };
 
+// A file extension, with the dot, and its MIME type.
+struct mime_type {
+  struct vec ext;
+  struct vec type;
+};
+
+// Headers looked up on every request, indexed when the request is parsed.
+enum known_header {
+  HEADER_RANGE, HEADER_IF_RANGE, HEADER_CONNECTION, HEADER_CONTENT_LENGTH,
+  HEADER_IF_NONE_MATCH, HEADER_IF_MODIFIED_SINCE, HEADER_AUTHORIZATION,
+  HEADER_ACCEPT_ENCODING, HEADER_REFERER, HEADER_USER_AGENT,
+  NUM_KNOWN_HEADERS
+};
+
+static const char *known_header_names[NUM_KNOWN_HEADERS] = {
+  "Range", "If-Range", "Connection", "Content-Length", "If-None-Match",
+  "If-Modified-Since", "Authorization", "Accept-Encoding", "Referer",
+  "User-Agent"
+};
+
 // Structure used by mg_stat() function. Uses 64 bit file length.
 struct mgstat {
   int is_directory;  // Directory marker
@@ -398,6 +456,26 @@ struct socket {
   int is_proxy;
 };
 
+// Slot in the ring of accepted sockets. The sequence number tells whose
+// turn it is: a producer at position pos may fill the slot when
+// seq == pos, a consumer may empty it when seq == pos + 1.
+struct sq_slot {
+  volatile unsigned int seq;
+  struct socket socket;
+};
+
+// Idle threads park on an event counter. A waiter registers itself and
+// samples the counter before re-checking its condition, and then sleeps
+// only if nobody bumped the counter in between, so wakeups are never lost.
+struct waitq {
+  volatile int seq;          // Bumped on every wakeup
+  volatile int waiters;      // Number of threads parked or about to park
+#if !defined(USE_FUTEX)
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+#endif // !USE_FUTEX
+};
+
 enum {
   CGI_EXTENSIONS, CGI_ENVIRONMENT, PUT_DELETE_PASSWORDS_FILE, CGI_INTERPRETER,
   PROTECT_URI, AUTHENTICATION_DOMAIN, SSI_EXTENSIONS, ACCESS_LOG_FILE,
@@ -406,7 +484,9 @@ enum {
   ENABLE_KEEP_ALIVE, ACCESS_CONTROL_LIST, MAX_REQUEST_SIZE,
   EXTRA_MIME_TYPES, LISTENING_PORTS,
   DOCUMENT_ROOT, SSL_CERTIFICATE, NUM_THREADS, RUN_AS_USER,
-  NUM_OPTIONS
+  ENABLE_EPOLL, SOCKET_QUEUE_SIZE, IO_BUFFER_SIZE, MAX_THREADS,
+  IDLE_THREAD_TIMEOUT, ENABLE_IO_URING, ACCESS_LOG_FLUSH_MS,
+  ACCESS_LOG_BATCH_SIZE, NUM_OPTIONS
 };
 
 static const char *config_options[] = {
@@ -430,8 +510,16 @@ static const char *config_options[] = {
   "p", "listening_ports", "8080",
   "r", "document_root",  ".",
   "s", "ssl_certificate", NULL,
-  "t", "num_threads", "10",
+  "t", "num_threads", NULL,
   "u", "run_as_user", NULL,
+  "x", "enable_epoll", "no",
+  "Q", "socket_queue_size", "128",
+  "b", "io_buffer_size", "262144",
+  "w", "max_threads", NULL,
+  "W", "idle_thread_timeout_ms", "30000",
+  "U", "enable_io_uring", "no",
+  "L", "access_log_flush_interval_ms", "1000",
+  "B", "access_log_batch_size", "65536",
   NULL
 };
 #define ENTRIES_PER_CONFIG_OPTION 3
@@ -444,18 +532,95 @@ struct mg_context {
   void *user_data;              // User-defined data
 
   struct socket *listening_sockets;
+  int io_buffer_size;           // Chunk size for reading files
+  int max_request_size;         // Request buffer of each worker
+  int enable_keep_alive;        // Options parsed by mg_start()
+  int enable_directory_listing;
+  struct vec *cgi_extensions;   // Ends with a NULL ptr
+  struct vec *ssi_extensions;
+  struct mime_type *mime_types; // Hash of single-dot extensions
+  unsigned int mime_types_mask; // Table size - 1, a power of two minus one
+  struct mime_type *mime_suffixes;  // Other extra_mime_types, in order
+  int num_mime_suffixes;
+  int use_io_uring;             // Send files through io_uring
 
   volatile int num_threads;  // Number of threads
-  pthread_mutex_t mutex;     // Protects (max|num)_threads
+  volatile int num_workers;  // Number of worker threads in the pool
+  volatile int idle_workers; // Workers waiting for a socket
+  int min_threads;           // Pool never shrinks below this
+  int max_threads;           // Pool never grows beyond this
+  int idle_timeout_ms;       // Extra workers exit after idling that long
+  struct thread_stats *thread_stats;  // Of running threads, under mutex
+  int64_t retired_bytes_sent;  // Counted by threads that exited, under mutex
+  int64_t retired_requests;
+  pthread_mutex_t mutex;     // Protects (max|num)_threads, num_workers
   pthread_cond_t  cond;      // Condvar for tracking workers terminations
 
-  struct socket queue[20];   // Accepted sockets
-  volatile int sq_head;      // Head of the socket queue
-  volatile int sq_tail;      // Tail of the socket queue
-  pthread_cond_t sq_full;    // Singaled when socket is produced
-  pthread_cond_t sq_empty;   // Signaled when socket is consumed
+  struct sq_slot *queue;         // Lock-free ring of accepted sockets
+  unsigned int sq_size;          // Ring capacity, a power of two
+  volatile unsigned int sq_head; // Next position to produce into
+  volatile unsigned int sq_tail; // Next position to consume from
+  struct waitq sq_not_empty;     // Idle workers park here
+  struct waitq sq_not_full;      // Master parks here if the ring is full
+
+  int log_enabled;               // The logger thread is running
+  struct log_ring *log_rings;    // One per worker, under log_mutex
+  pthread_mutex_t log_mutex;
+  struct waitq log_wakeup;       // Logger parks here between flushes
+  int log_flush_ms;              // Longest time a record waits in a ring
+  int log_batch_size;            // Bytes per write() to the access log
+  unsigned int log_dropped;      // Records lost so far, logger only
+
+#if defined(USE_EPOLL)
+  int epoll_fd;                 // Reactor for offloaded file sends, or -1
+  struct transfer *transfers;   // Offloaded sends in flight, under mutex
+  volatile int num_transfers;   // Length of that list
+  pthread_cond_t transfers_done;  // Signaled when the last one ends
+#endif // USE_EPOLL
+};
+
+// Traffic counters of a worker or of the reactor. Only the owner thread
+// writes them, and the padding keeps other threads' data off their cache
+// line, so counting costs no more than a private increment.
+// mg_get_server_stats() sums them up.
+struct thread_stats {
+  char pad_before[64];
+  struct thread_stats *next;    // Linkage in ctx->thread_stats, under mutex
+  volatile int64_t bytes_sent;  // Body and headers, as they go out
+  volatile int64_t requests;    // Requests served
+  volatile int active;          // Serving a connection right now
+  char pad_after[64];
+};
+
+// Access log records are formatted by the worker into its own ring, and
+// written out in batches by the logger thread. A full ring drops records
+// rather than making the worker wait for the disk.
+#define LOG_RECORD_SIZE 512
+#define LOG_RING_SIZE 256    // Records per ring, a power of two
+
+// Single-producer/single-consumer ring of access log lines.
+struct log_ring {
+  struct log_ring *next;          // Linkage in ctx->log_rings
+  volatile unsigned int head;     // Next record the worker fills
+  volatile unsigned int dropped;  // Records lost to a full ring
+  volatile int retired;           // Worker is gone, free once drained
+  char pad[64];                   // Keep the logger's tail off this line
+  volatile unsigned int tail;     // Next record the logger writes out
+  char records[LOG_RING_SIZE][LOG_RECORD_SIZE];
 };
 
+#if defined(USE_EPOLL)
+// File body handed over by a worker thread to the reactor thread, which
+// pushes it out whenever the non-blocking socket becomes writable.
+struct transfer {
+  struct transfer *prev, *next;  // Linkage in ctx->transfers
+  SOCKET sock;                   // Client socket, owned by the transfer
+  int fd;                        // Duplicated file descriptor
+  off_t offset;                  // Next file offset to send
+  int64_t remaining;             // Bytes left to send
+};
+#endif // USE_EPOLL
+
 struct mg_connection {
   struct mg_connection *peer; // Remote target in proxy mode
   struct mg_request_info request_info;
@@ -470,6 +635,15 @@ struct mg_connection {
   int buf_size;               // Buffer size
   int request_len;            // Size of the request + headers in a buffer
   int data_len;               // Total size of data in a buffer
+  unsigned char header_slots[NUM_KNOWN_HEADERS]; // 1 + index in http_headers
+  time_t date_time;           // Second the Date header below was made for
+  char date[32];              // Date header value, cached by the worker
+#if defined(USE_IO_URING)
+  struct uring *ring;         // Worker's io_uring, created on first use
+  int no_ring;                // Worker couldn't create one, it sends without
+#endif // USE_IO_URING
+  struct log_ring *log_ring;  // Worker's access log records
+  struct thread_stats stats;  // Counted by the worker owning conn
 };
 
 const char **mg_get_valid_option_names(void) {
@@ -505,6 +679,79 @@ const char *mg_get_option(const struct mg_context *ctx, const char *name) {
   }
 }
 
+void mg_get_pool_stats(const struct mg_context *ctx,
+                       struct mg_pool_stats *stats) {
+  unsigned int head = __atomic_load_n(&ctx->sq_head, __ATOMIC_RELAXED);
+  unsigned int tail = __atomic_load_n(&ctx->sq_tail, __ATOMIC_RELAXED);
+
+  stats->num_threads = ctx->num_workers;
+  stats->idle_threads = ctx->idle_workers;
+  stats->min_threads = ctx->min_threads;
+  stats->max_threads = ctx->max_threads;
+  stats->queue_depth = (int) (head - tail) < 0 ? 0 : (int) (head - tail);
+  stats->queue_size = (int) ctx->sq_size;
+#if defined(USE_EPOLL)
+  stats->num_transfers = ctx->num_transfers;
+#else
+  stats->num_transfers = 0;
+#endif // USE_EPOLL
+}
+
+void mg_wait_for_transfers(struct mg_context *ctx) {
+#if defined(USE_EPOLL)
+  (void) pthread_mutex_lock(&ctx->mutex);
+  while (ctx->num_transfers > 0) {
+    (void) pthread_cond_wait(&ctx->transfers_done, &ctx->mutex);
+  }
+  (void) pthread_mutex_unlock(&ctx->mutex);
+#else
+  (void) ctx;
+#endif // USE_EPOLL
+}
+
+// Start counting the traffic of the calling thread in stats.
+static void add_thread_stats(struct mg_context *ctx,
+                             struct thread_stats *stats) {
+  memset(stats, 0, sizeof(*stats));
+  (void) pthread_mutex_lock(&ctx->mutex);
+  stats->next = ctx->thread_stats;
+  ctx->thread_stats = stats;
+  (void) pthread_mutex_unlock(&ctx->mutex);
+}
+
+// The thread is exiting, keep what it counted in the context.
+static void remove_thread_stats(struct mg_context *ctx,
+                                struct thread_stats *stats) {
+  struct thread_stats **link;
+
+  (void) pthread_mutex_lock(&ctx->mutex);
+  for (link = &ctx->thread_stats; *link != stats; link = &(*link)->next)
+    ;
+  *link = stats->next;
+  ctx->retired_bytes_sent += stats->bytes_sent;
+  ctx->retired_requests += stats->requests;
+  (void) pthread_mutex_unlock(&ctx->mutex);
+}
+
+void mg_get_server_stats(struct mg_context *ctx,
+                         struct mg_server_stats *stats) {
+  struct thread_stats *ts;
+
+  (void) pthread_mutex_lock(&ctx->mutex);
+  stats->bytes_sent = ctx->retired_bytes_sent;
+  stats->requests = ctx->retired_requests;
+  stats->active_connections = 0;
+  for (ts = ctx->thread_stats; ts != NULL; ts = ts->next) {
+    stats->bytes_sent += ts->bytes_sent;
+    stats->requests += ts->requests;
+    stats->active_connections += ts->active;
+  }
+#if defined(USE_EPOLL)
+  stats->active_connections += ctx->num_transfers;
+#endif // USE_EPOLL
+  (void) pthread_mutex_unlock(&ctx->mutex);
+}
+
 // Print error message to the opened error log stream.
 static void cry(struct mg_connection *conn, const char *fmt, ...) {
   char buf[BUFSIZ];
@@ -653,6 +900,137 @@ static int mg_snprintf(struct mg_connection *conn, char *buf, size_t buflen,
   return n;
 }
 
+// Byte scanning kernels of the request parser. Each set gives the same
+// results, select_scanner() picks the fastest one the CPU supports.
+struct scanner {
+  const char *name;
+  // First control character (below 0x20, CR and LF included, HTAB not) or
+  // DEL in [s, end), or end.
+  const char *(*find_control)(const char *s, const char *end);
+  // First a, b or '\0' in the 0-terminated s.
+  const char *(*find_either)(const char *s, char a, char b);
+};
+
+static int is_control(unsigned char c) {
+  return (c < 0x20 && c != '\t') || c == 0x7f;
+}
+
+static const char *find_control_scalar(const char *s, const char *end) {
+  while (s < end && !is_control(* (const unsigned char *) s)) {
+    s++;
+  }
+  return s;
+}
+
+static const char *find_either_scalar(const char *s, char a, char b) {
+  while (*s != '\0' && *s != a && *s != b) {
+    s++;
+  }
+  return s;
+}
+
+#if defined(USE_SSE2)
+static const char *find_control_sse2(const char *s, const char *end) {
+  const __m128i high = _mm_set1_epi8((char) 0xe0), del = _mm_set1_epi8(0x7f);
+  const __m128i tab = _mm_set1_epi8('\t');
+  __m128i v;
+  int mask;
+
+  for (; end - s >= 16; s += 16) {
+    v = _mm_loadu_si128((const __m128i *) s);
+    mask = _mm_movemask_epi8(_mm_or_si128(_mm_andnot_si128(
+        _mm_cmpeq_epi8(v, tab),
+        _mm_cmpeq_epi8(_mm_and_si128(v, high), _mm_setzero_si128())),
+        _mm_cmpeq_epi8(v, del)));
+    if (mask != 0) {
+      return s + __builtin_ctz(mask);
+    }
+  }
+  return find_control_scalar(s, end);
+}
+
+// Aligned loads never cross into the next page, so reading the rest of
+// the block past the terminating zero is safe.
+static const char *find_either_sse2(const char *s, char a, char b) {
+  const __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b);
+  const __m128i *p = (const __m128i *) ((uintptr_t) s & ~(uintptr_t) 15);
+  unsigned int mask, skip = (unsigned int) ((uintptr_t) s & 15);
+  __m128i v;
+
+  for (;; p++, skip = 0) {
+    v = _mm_load_si128(p);
+    mask = (unsigned int) _mm_movemask_epi8(_mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)),
+        _mm_cmpeq_epi8(v, _mm_setzero_si128()))) >> skip << skip;
+    if (mask != 0) {
+      return (const char *) p + __builtin_ctz(mask);
+    }
+  }
+}
+#endif // USE_SSE2
+
+#if defined(USE_AVX2)
+// Only the delimiter scan, which runs over whole tokens. Header lines are
+// short enough that a 32-byte control scan was slower than the 16-byte one
+// in bench/parse_bench.
+__attribute__((target("avx2")))
+static const char *find_either_avx2(const char *s, char a, char b) {
+  const __m256i va = _mm256_set1_epi8(a), vb = _mm256_set1_epi8(b);
+  const __m256i *p = (const __m256i *) ((uintptr_t) s & ~(uintptr_t) 31);
+  unsigned int mask, skip = (unsigned int) ((uintptr_t) s & 31);
+  __m256i v;
+
+  for (;; p++, skip = 0) {
+    v = _mm256_load_si256(p);
+    mask = (unsigned int) _mm256_movemask_epi8(_mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb)),
+        _mm256_cmpeq_epi8(v, _mm256_setzero_si256()))) >> skip << skip;
+    if (mask != 0) {
+      return (const char *) p + __builtin_ctz(mask);
+    }
+  }
+}
+#endif // USE_AVX2
+
+// Ordered from the most portable to the fastest.
+static const struct scanner scanners[] = {
+  {"scalar", find_control_scalar, find_either_scalar},
+#if defined(USE_SSE2)
+  {"sse2", find_control_sse2, find_either_sse2},
+#endif // USE_SSE2
+#if defined(USE_AVX2)
+  {"avx2", find_control_sse2, find_either_avx2},
+#endif // USE_AVX2
+};
+
+// SSE2 is there whenever it's compiled in, AVX2 has to be asked for.
+#if defined(USE_SSE2)
+static const struct scanner *scanner = &scanners[1];
+#else
+static const struct scanner *scanner = &scanners[0];
+#endif // USE_SSE2
+
+static void select_scanner(void) {
+#if defined(USE_AVX2)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    scanner = &scanners[ARRAY_SIZE(scanners) - 1];
+  }
+#endif // USE_AVX2
+}
+
+// Length of the initial segment of s without any of the delimiters, like
+// strcspn(). One or two delimiters, as in all the request parsing, take
+// the vectorized path.
+static size_t span_delimiters(const char *s, const char *delimiters) {
+  if (delimiters[0] != '\0' &&
+      (delimiters[1] == '\0' || delimiters[2] == '\0')) {
+    return (size_t) (scanner->find_either(s, delimiters[0],
+        delimiters[1] == '\0' ? delimiters[0] : delimiters[1]) - s);
+  }
+  return strcspn(s, delimiters);
+}
+
 // Skip the characters until one of the delimiters characters found.
 // 0-terminate resulting word. Skip the delimiter and following whitespaces if any.
 // Advance pointer to buffer to the next word. Return found 0-terminated word.
@@ -661,7 +1039,7 @@ static char *skip_quoted(char **buf, const char *delimiters, const char *whitesp
   char *p, *begin_word, *end_word, *end_whitespace;
 
   begin_word = *buf;
-  end_word = begin_word + strcspn(begin_word, delimiters);
+  end_word = begin_word + span_delimiters(begin_word, delimiters);
 
   // Check for quotechar
   if (end_word > begin_word) {
@@ -672,7 +1050,7 @@ static char *skip_quoted(char **buf, const char *delimiters, const char *whitesp
         *p = '\0';
         break;
       } else {
-        size_t end_off = strcspn(end_word + 1, delimiters);
+        size_t end_off = span_delimiters(end_word + 1, delimiters);
         memmove (p, end_word, end_off + 1);
         p += end_off; // p must correspond to end_word - 1
         end_word += end_off + 1;
@@ -717,8 +1095,40 @@ static const char *get_header(const struct mg_request_info *ri,
   return NULL;
 }
 
+// Return the known_header the name is, or -1. The length and the first
+// letter leave at most one candidate to compare with.
+static int known_header_id(const char *name) {
+  int id;
+
+  switch (strlen(name)) {
+    case 5: id = HEADER_RANGE; break;
+    case 7: id = HEADER_REFERER; break;
+    case 8: id = HEADER_IF_RANGE; break;
+    case 10: id = lowercase(name) == 'u' ? HEADER_USER_AGENT :
+                 HEADER_CONNECTION; break;
+    case 13: id = lowercase(name) == 'a' ? HEADER_AUTHORIZATION :
+                 HEADER_IF_NONE_MATCH; break;
+    case 14: id = HEADER_CONTENT_LENGTH; break;
+    case 15: id = HEADER_ACCEPT_ENCODING; break;
+    case 17: id = HEADER_IF_MODIFIED_SINCE; break;
+    default: return -1;
+  }
+
+  return mg_strcasecmp(name, known_header_names[id]) ? -1 : id;
+}
+
+// Return the value of a header indexed at parse time, or NULL if the
+// request has none.
+static const char *get_known_header(const struct mg_connection *conn,
+                                    enum known_header id) {
+  int slot = conn->header_slots[id];
+  return slot == 0 ? NULL : conn->request_info.http_headers[slot - 1].value;
+}
+
 const char *mg_get_header(const struct mg_connection *conn, const char *name) {
-  return get_header(&conn->request_info, name);
+  int id = known_header_id(name);
+  return id < 0 ? get_header(&conn->request_info, name) :
+    get_known_header(conn, (enum known_header) id);
 }
 
 // A helper function for traversing comma separated list of values.
@@ -760,16 +1170,30 @@ static const char *next_option(const char *list, struct vec *val,
   return list;
 }
 
-static int match_extension(const char *path, const char *ext_list) {
-  struct vec ext_vec;
+// Split a comma separated list of extensions into an array ending with a
+// NULL ptr. The vectors point into the list. Return NULL if out of memory.
+static struct vec *compile_extension_list(const char *list) {
+  struct vec ext_vec, *exts;
+  const char *p;
+  int n;
+
+  for (n = 0, p = list; (p = next_option(p, &ext_vec, NULL)) != NULL; n++);
+  if ((exts = (struct vec *) calloc(n + 1, sizeof(*exts))) != NULL) {
+    for (n = 0; (list = next_option(list, &exts[n], NULL)) != NULL; n++);
+  }
+
+  return exts;
+}
+
+static int match_extension(const char *path, const struct vec *exts) {
   size_t path_len;
 
   path_len = strlen(path);
 
-  while ((ext_list = next_option(ext_list, &ext_vec, NULL)) != NULL)
-    if (ext_vec.len < path_len &&
-        mg_strncasecmp(path + path_len - ext_vec.len,
-          ext_vec.ptr, ext_vec.len) == 0)
+  for (; exts->ptr != NULL; exts++)
+    if (exts->len < path_len &&
+        mg_strncasecmp(path + path_len - exts->len,
+          exts->ptr, exts->len) == 0)
       return 1;
 
   return 0;
@@ -780,8 +1204,8 @@ static int match_extension(const char *path, const char *ext_list) {
 // set up, for example if request parsing failed.
 static int should_keep_alive(const struct mg_connection *conn) {
   const char *http_version = conn->request_info.http_version;
-  const char *header = mg_get_header(conn, "Connection");
-  return (!mg_strcasecmp(conn->ctx->config[ENABLE_KEEP_ALIVE], "yes") &&
+  const char *header = get_known_header(conn, HEADER_CONNECTION);
+  return (conn->ctx->enable_keep_alive &&
           (header == NULL && http_version && !strcmp(http_version, "1.1"))) ||
           (header != NULL && !mg_strcasecmp(header, "keep-alive"));
 }
@@ -1399,8 +1823,12 @@ int mg_read(struct mg_connection *conn, void *buf, size_t len) {
 }
 
 int mg_write(struct mg_connection *conn, const void *buf, size_t len) {
-  return (int) push(NULL, conn->client.sock, conn->ssl,
-      (const char *) buf, (int64_t) len);
+  int64_t n = push(NULL, conn->client.sock, conn->ssl,
+                   (const char *) buf, (int64_t) len);
+  if (n > 0) {
+    conn->stats.bytes_sent += n;
+  }
+  return (int) n;
 }
 
 int mg_printf(struct mg_connection *conn, const char *fmt, ...) {
@@ -1609,22 +2037,26 @@ static struct mg_connection *mg_connect(struct mg_connection *conn,
 //   >0  actual request length, including last \r\n\r\n
 static int get_request_len(const char *buf, int buflen) {
   const char *s, *e;
-  int len = 0;
+  int malformed = 0;
 
   DEBUG_TRACE(("buf: %p, len: %d", buf, buflen));
-  for (s = buf, e = s + buflen - 1; len <= 0 && s < e; s++)
-    // Control characters are not allowed but >=128 is.
-    if (!isprint(* (const unsigned char *) s) && *s != '\r' &&
-        *s != '\n' && * (const unsigned char *) s < 128) {
-      len = -1;
+  // Only control characters need a closer look: CR and LF end the headers,
+  // the others are not allowed, but only make the request malformed if it
+  // doesn't end in the buffer. HTAB and >=128 are allowed.
+  for (s = buf, e = s + buflen - 1; s < e; s++) {
+    if ((s = scanner->find_control(s, e)) >= e) {
+      break;
     } else if (s[0] == '\n' && s[1] == '\n') {
-      len = (int) (s - buf) + 2;
+      return (int) (s - buf) + 2;
     } else if (s[0] == '\n' && &s[1] < e &&
         s[1] == '\r' && s[2] == '\n') {
-      len = (int) (s - buf) + 3;
+      return (int) (s - buf) + 3;
+    } else if (*s != '\r' && *s != '\n') {
+      malformed = 1;
     }
+  }
 
-  return len;
+  return malformed ? -1 : 0;
 }
 
 // Convert month to the month number. Return -1 on error, or month number
@@ -1737,37 +2169,110 @@ static const struct {
   {NULL,  0, NULL,    0}
 };
 
+// FNV-1a of the lower-cased extension, so that lookups ignore case.
+static unsigned int hash_extension(const char *ext, size_t len) {
+  unsigned int h = 2166136261U;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    h = (h ^ (unsigned char) lowercase(ext + i)) * 16777619U;
+  }
+  return h;
+}
+
+// Return the slot of ext in the MIME hash, or the free slot it would go to.
+static struct mime_type *find_mime_slot(const struct mg_context *ctx,
+                                        const char *ext, size_t len) {
+  unsigned int i = hash_extension(ext, len) & ctx->mime_types_mask;
+  struct mime_type *slot;
+
+  for (;; i = (i + 1) & ctx->mime_types_mask) {
+    slot = &ctx->mime_types[i];
+    if (slot->ext.ptr == NULL || (slot->ext.len == len &&
+        mg_strncasecmp(slot->ext.ptr, ext, len) == 0)) {
+      return slot;
+    }
+  }
+}
+
+// Compile extra_mime_types and the built-in types into a hash keyed by the
+// extension, extra types first so they override the built-in ones.
+// Extensions with more than one dot, like ".tar.gz", can't be found from
+// the last dot of a path, so they are kept in a list that is tried first.
+static int set_mime_types_option(struct mg_context *ctx) {
+  struct mime_type *slot, type;
+  const char *list;
+  unsigned int size;
+  int i, n = 0;
+
+  list = ctx->config[EXTRA_MIME_TYPES];
+  while ((list = next_option(list, &type.ext, &type.type)) != NULL) {
+    n++;
+  }
+  for (i = 0; builtin_mime_types[i].extension != NULL; i++) {
+    n++;
+  }
+
+  // At most half full, so that probe sequences stay short
+  for (size = 16; size < 2 * (unsigned int) n; size *= 2);
+  ctx->mime_types = (struct mime_type *) calloc(size, sizeof(*slot));
+  ctx->mime_suffixes = (struct mime_type *) calloc(n, sizeof(*slot));
+  if (ctx->mime_types == NULL || ctx->mime_suffixes == NULL) {
+    cry(fc(ctx), "%s: cannot allocate MIME types", __func__);
+    return 0;
+  }
+  ctx->mime_types_mask = size - 1;
+
+  list = ctx->config[EXTRA_MIME_TYPES];
+  while ((list = next_option(list, &type.ext, &type.type)) != NULL) {
+    if (type.ext.len < 2 || type.ext.ptr[0] != '.' ||
+        memchr(type.ext.ptr + 1, '.', type.ext.len - 1) != NULL) {
+      ctx->mime_suffixes[ctx->num_mime_suffixes++] = type;
+    } else if ((slot = find_mime_slot(ctx, type.ext.ptr,
+                                      type.ext.len))->ext.ptr == NULL) {
+      *slot = type;
+    }
+  }
+
+  for (i = 0; builtin_mime_types[i].extension != NULL; i++) {
+    slot = find_mime_slot(ctx, builtin_mime_types[i].extension,
+                          builtin_mime_types[i].ext_len);
+    if (slot->ext.ptr == NULL) {
+      slot->ext.ptr = builtin_mime_types[i].extension;
+      slot->ext.len = builtin_mime_types[i].ext_len;
+      slot->type.ptr = builtin_mime_types[i].mime_type;
+      slot->type.len = builtin_mime_types[i].mime_type_len;
+    }
+  }
+
+  return 1;
+}
+
 // Look at the "path" extension and figure what mime type it has.
 // Store mime type in the vector.
 static void get_mime_type(struct mg_context *ctx, const char *path,
                           struct vec *vec) {
-  struct vec ext_vec, mime_vec;
-  const char *list, *ext;
-  size_t i, path_len;
+  const struct mime_type *type;
+  const char *ext;
+  size_t path_len;
+  int i;
 
   path_len = strlen(path);
 
-  // Scan user-defined mime types first, in case user wants to
-  // override default mime types.
-  list = ctx->config[EXTRA_MIME_TYPES];
-  while ((list = next_option(list, &ext_vec, &mime_vec)) != NULL) {
-    // ext now points to the path suffix
-    ext = path + path_len - ext_vec.len;
-    if (mg_strncasecmp(ext, ext_vec.ptr, ext_vec.len) == 0) {
-      *vec = mime_vec;
+  for (i = 0; i < ctx->num_mime_suffixes; i++) {
+    type = &ctx->mime_suffixes[i];
+    if (type->ext.len < path_len &&
+        mg_strncasecmp(path + path_len - type->ext.len,
+                       type->ext.ptr, type->ext.len) == 0) {
+      *vec = type->type;
       return;
     }
   }
 
-  // Now scan built-in mime types
-  for (i = 0; builtin_mime_types[i].extension != NULL; i++) {
-    ext = path + (path_len - builtin_mime_types[i].ext_len);
-    if (path_len > builtin_mime_types[i].ext_len &&
-        mg_strcasecmp(ext, builtin_mime_types[i].extension) == 0) {
-      vec->ptr = builtin_mime_types[i].mime_type;
-      vec->len = builtin_mime_types[i].mime_type_len;
-      return;
-    }
+  if ((ext = strrchr(path, '.')) != NULL && ext != path &&
+      (type = find_mime_slot(ctx, ext, path + path_len - ext))->ext.ptr != NULL) {
+    *vec = type->type;
+    return;
   }
 
   // Nothing found. Fall back to "text/plain"
@@ -2064,7 +2569,7 @@ static int parse_auth_header(struct mg_connection *conn, char *buf,
   char *name, *value, *s;
   const char *auth_header;
 
-  if ((auth_header = mg_get_header(conn, "Authorization")) == NULL ||
+  if ((auth_header = get_known_header(conn, HEADER_AUTHORIZATION)) == NULL ||
       mg_strncasecmp(auth_header, "Digest ", 7) != 0) {
     return 0;
   }
@@ -2299,6 +2804,10 @@ static void url_encode(const char *src, char *dst, size_t dst_len) {
   *dst = '\0';
 }
 
+void mg_url_encode(const char *src, char *dst, size_t dst_len) {
+  url_encode(src, dst, dst_len);
+}
+
 static void print_dir_entry(struct de *de) {
   char size[64], mod[64], href[PATH_MAX];
 
@@ -2472,18 +2981,379 @@ static void handle_directory_request(struct mg_connection *conn,
   conn->request_info.status_code = 200;
 }
 
+#if defined(POSIX_FADV_SEQUENTIAL)
+// Hint the kernel about a sequential read of fd that has reached offset:
+// read the next chunk ahead, and drop the one before the previous chunk
+// from the page cache, so that huge files do not push everything else out.
+static void advise_sequential(int fd, int64_t offset, int64_t chunk) {
+  (void) posix_fadvise(fd, (off_t) offset, (off_t) chunk, POSIX_FADV_WILLNEED);
+  if (offset >= 2 * chunk) {
+    (void) posix_fadvise(fd, (off_t) (offset - 2 * chunk), (off_t) chunk,
+                         POSIX_FADV_DONTNEED);
+  }
+}
+#else
+#define advise_sequential(fd, offset, chunk)
+#endif // POSIX_FADV_SEQUENTIAL
+
+#if defined(USE_SENDFILE)
+// Send up to len bytes from the current position of fp with sendfile(),
+// which moves data from the page cache to the socket without copying it
+// through user space. The file position is advanced past the sent bytes.
+// Return the number of bytes sent, or -1 if the connection failed. A short
+// count without an error means the file cannot be sendfile()-d, or that it
+// ended early, and the caller should copy the rest itself.
+static int64_t send_file_data_zero_copy(struct mg_connection *conn, FILE *fp,
+                                        int64_t len) {
+  off_t offset;
+  int64_t sent = 0;
+  ssize_t n;
+  size_t k;
+
+  if ((offset = ftello(fp)) < 0) {
+    return 0;
+  }
+
+  while (sent < len) {
+    k = len - sent > conn->ctx->io_buffer_size ?
+      (size_t) conn->ctx->io_buffer_size : (size_t) (len - sent);
+    advise_sequential(fileno(fp), offset, conn->ctx->io_buffer_size);
+    n = sendfile(conn->client.sock, fileno(fp), &offset, k);
+    if (n < 0 && ERRNO == EINTR) {
+      continue;
+    } else if (n < 0 && (ERRNO == EINVAL || ERRNO == ENOSYS) && sent == 0) {
+      break;  // Not supported for this file or socket, copy instead
+    } else if (n == 0) {
+      break;  // The file shrank, the copy finds the same end of file
+    } else if (n < 0) {
+      sent = -1;
+      break;
+    }
+    sent += n;
+    conn->num_bytes_sent += n;
+    conn->stats.bytes_sent += n;
+  }
+
+  (void) fseeko(fp, offset, SEEK_SET);
+  return sent;
+}
+#endif // USE_SENDFILE
+
+#if defined(USE_IO_URING)
+#define URING_BUFFERS 4  // File chunks in flight per io_uring_enter()
+
+// io_uring instance driven with raw system calls. Every worker that sends
+// files owns one, with URING_BUFFERS registered buffers of io_buffer_size.
+struct uring {
+  int fd;
+  void *ring;                 // Shared SQ and CQ rings
+  size_t ring_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned int *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+  char *bufs;
+  size_t buf_size;
+  unsigned int queued;        // Requests queued since the last uring_run()
+};
+
+static int uring_setup(unsigned int entries, struct io_uring_params *p) {
+  return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned int to_submit,
+                       unsigned int min_complete) {
+  return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                       IORING_ENTER_GETEVENTS, NULL, 0);
+}
+
+// Check whether the running kernel can do what we need: io_uring with
+// a single mmap for both rings, which came together with everything else.
+static int uring_supported(void) {
+  struct io_uring_params p;
+  int fd;
+
+  memset(&p, 0, sizeof(p));
+  if ((fd = uring_setup(1, &p)) < 0) {
+    return 0;
+  }
+  (void) close(fd);
+  return (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+}
+
+static void uring_free(struct uring *r) {
+  if (r->sqes != NULL) {
+    (void) munmap(r->sqes, r->sqes_size);
+  }
+  if (r->ring != NULL) {
+    (void) munmap(r->ring, r->ring_size);
+  }
+  if (r->fd >= 0) {
+    (void) close(r->fd);
+  }
+  free(r->bufs);
+  free(r);
+}
+
+static struct uring *uring_create(size_t buf_size) {
+  struct io_uring_params p;
+  struct iovec iov[URING_BUFFERS];
+  struct uring *r;
+  size_t cq_size;
+  char *ring;
+  void *sqes;
+  int i;
+
+  if ((r = (struct uring *) calloc(1, sizeof(*r))) == NULL) {
+    return NULL;
+  }
+  memset(&p, 0, sizeof(p));
+  if ((r->fd = uring_setup(2 * URING_BUFFERS, &p)) < 0 ||
+      !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+    uring_free(r);
+    return NULL;
+  }
+  set_close_on_exec(r->fd);
+
+  r->ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+  cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (cq_size > r->ring_size) {
+    r->ring_size = cq_size;
+  }
+  r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring = (char *) mmap(NULL, r->ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  r->ring = ring == MAP_FAILED ? NULL : ring;
+  sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  r->sqes = sqes == MAP_FAILED ? NULL : (struct io_uring_sqe *) sqes;
+  r->buf_size = buf_size;
+  r->bufs = (char *) malloc(URING_BUFFERS * buf_size);
+  if (r->ring == NULL || r->sqes == NULL || r->bufs == NULL) {
+    uring_free(r);
+    return NULL;
+  }
+
+  r->sq_head = (unsigned int *) (ring + p.sq_off.head);
+  r->sq_tail = (unsigned int *) (ring + p.sq_off.tail);
+  r->sq_mask = (unsigned int *) (ring + p.sq_off.ring_mask);
+  r->sq_array = (unsigned int *) (ring + p.sq_off.array);
+  r->cq_head = (unsigned int *) (ring + p.cq_off.head);
+  r->cq_tail = (unsigned int *) (ring + p.cq_off.tail);
+  r->cq_mask = (unsigned int *) (ring + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *) (ring + p.cq_off.cqes);
+
+  // Registered buffers are pinned once, instead of on every request
+  for (i = 0; i < URING_BUFFERS; i++) {
+    iov[i].iov_base = r->bufs + i * buf_size;
+    iov[i].iov_len = buf_size;
+  }
+  if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS,
+              iov, URING_BUFFERS) != 0) {
+    uring_free(r);
+    return NULL;
+  }
+
+  return r;
+}
+
+// Queue a read or write of registered buffer i. Nothing reaches the
+// kernel until uring_run().
+static void uring_prep(struct uring *r, int opcode, int fd, int i,
+                       size_t len, int64_t offset, int flags) {
+  unsigned int tail = *r->sq_tail;
+  unsigned int index = tail & *r->sq_mask;
+  struct io_uring_sqe *sqe = &r->sqes[index];
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = (unsigned char) opcode;
+  sqe->flags = (unsigned char) flags;
+  sqe->fd = fd;
+  sqe->off = (unsigned long long) offset;
+  sqe->addr = (unsigned long long) (uintptr_t) (r->bufs + i * r->buf_size);
+  sqe->len = (unsigned int) len;
+  sqe->buf_index = (unsigned short) i;
+  sqe->user_data = r->queued++;
+  r->sq_array[index] = index;
+  __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// Submit the queued requests and wait for all of them. The result of the
+// request queued k-th is stored in res[k]. Return 0 on success, -1 if the
+// kernel took none of them, or -2 if it failed after taking some, whose
+// outcome is then unknown.
+static int uring_run(struct uring *r, int *res) {
+  unsigned int head, n = r->queued, done = 0, submitted = 0;
+  unsigned int sq_head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+  struct io_uring_cqe *cqe;
+  int rc;
+
+  r->queued = 0;
+  while (done < n) {
+    rc = uring_enter(r->fd, n - submitted, n - done);
+    if (rc < 0 && ERRNO != EINTR) {
+      // The kernel's SQ head tells if it took any, whatever rc says
+      return __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) != sq_head ? -2 : -1;
+    } else if (rc > 0) {
+      submitted += rc;
+    }
+    head = *r->cq_head;
+    while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+      cqe = &r->cqes[head & *r->cq_mask];
+      if (cqe->user_data < n) {
+        res[cqe->user_data] = cqe->res;
+      }
+      done++;
+      head++;
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+  }
+
+  return 0;
+}
+
+// Send up to len bytes from the current position of fp through io_uring.
+// Every chunk is read into a registered buffer by one request and written
+// to the socket by a linked one. All pairs of a batch form a single chain,
+// so writes go out in order, and a batch costs one io_uring_enter() call.
+// Return the number of bytes sent, or -1 if the connection failed.
+static int64_t send_file_data_uring(struct mg_connection *conn, FILE *fp,
+                                    int64_t len) {
+  struct uring *r = conn->ring;
+  int res[2 * URING_BUFFERS];
+  int64_t sent = 0, left;
+  off_t offset;
+  size_t chunk[URING_BUFFERS];
+  int i, n, rd, wr, rc, fd = fileno(fp), stop = 0;
+
+  if (r == NULL && conn->no_ring) {
+    return 0;
+  } else if (r == NULL &&
+      (r = conn->ring = uring_create(conn->ctx->io_buffer_size)) == NULL) {
+    // E.g. RLIMIT_MEMLOCK is too low for this worker's registered buffers.
+    // Only this worker falls back, the others keep the rings they have.
+    cry(conn, "%s: cannot set up io_uring, falling back", __func__);
+    conn->no_ring = 1;
+    return 0;
+  } else if ((offset = ftello(fp)) < 0) {
+    return 0;
+  }
+
+  while (sent < len && !stop) {
+    advise_sequential(fd, offset, (int64_t) (URING_BUFFERS * r->buf_size));
+    left = len - sent;
+    for (n = 0; n < URING_BUFFERS && left > 0; n++) {
+      chunk[n] = left > (int64_t) r->buf_size ? r->buf_size : (size_t) left;
+      left -= chunk[n];
+    }
+    for (i = 0; i < n; i++) {
+      uring_prep(r, IORING_OP_READ_FIXED, fd, i, chunk[i],
+                 offset + (int64_t) i * r->buf_size, IOSQE_IO_LINK);
+      uring_prep(r, IORING_OP_WRITE_FIXED, conn->client.sock, i, chunk[i],
+                 0, i + 1 < n ? IOSQE_IO_LINK : 0);
+    }
+    if ((rc = uring_run(r, res)) != 0) {
+      // Ring is in an unknown state, drop it. If the kernel took none of
+      // the batch, the caller copies from offset. Otherwise writes may have
+      // gone out past offset, and carrying on would corrupt the body: close
+      // the connection before the ring, so that none go out later either.
+      if (rc == -2) {
+        (void) shutdown(conn->client.sock, SHUT_RDWR);
+        sent = -1;
+      }
+      uring_free(r);
+      conn->ring = NULL;
+      break;
+    }
+
+    // The chain stops at the first short or failed request, and everything
+    // after it is cancelled.
+    for (i = 0; i < n && !stop; i++) {
+      rd = res[2 * i];
+      wr = res[2 * i + 1];
+      if (rd <= 0) {
+        stop = 1;  // Read error or EOF, the caller retries and reports it
+        break;
+      } else if (wr < 0 && wr != -ECANCELED) {
+        sent = -1;  // Client went away
+        break;
+      } else if (wr < rd) {
+        // Partial write, or the write got cancelled by a short read.
+        // Finish this buffer by hand and start a new chain after it.
+        wr = wr < 0 ? 0 : wr;
+        if (push(NULL, conn->client.sock, NULL,
+                 r->bufs + i * r->buf_size + wr, rd - wr) != rd - wr) {
+          sent = -1;
+          break;
+        }
+        n = i + 1;
+      }
+      if ((size_t) rd < chunk[i]) {
+        n = i + 1;  // Short read, the file has shrunk
+      }
+      sent += rd;
+      offset += rd;
+      conn->num_bytes_sent += rd;
+      conn->stats.bytes_sent += rd;
+    }
+    if (sent < 0) {
+      break;
+    }
+  }
+
+  (void) fseeko(fp, offset, SEEK_SET);
+  return sent;
+}
+#endif // USE_IO_URING
+
 // Send len bytes from the opened file to the client.
 static void send_file_data(struct mg_connection *conn, FILE *fp, int64_t len) {
-  char buf[BUFSIZ];
-  int to_read, num_read, num_written;
+  char *buf;
+  int buf_size, to_read, num_read, num_written;
+
+#if defined(POSIX_FADV_SEQUENTIAL)
+  (void) posix_fadvise(fileno(fp), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif // POSIX_FADV_SEQUENTIAL
+
+#if defined(USE_IO_URING)
+  if (conn->ssl == NULL && conn->ctx->use_io_uring && len > 0) {
+    int64_t sent = send_file_data_uring(conn, fp, len);
+    if (sent < 0) {
+      return;
+    }
+    len -= sent;
+  }
+#endif // USE_IO_URING
+
+#if defined(USE_SENDFILE)
+  // Plain sockets take the zero-copy path, SSL has to encrypt in user space
+  if (conn->ssl == NULL && len > 0) {
+    int64_t sent = send_file_data_zero_copy(conn, fp, len);
+    if (sent < 0) {
+      return;
+    }
+    len -= sent;
+  }
+#endif // USE_SENDFILE
+
+  if (len <= 0) {
+    return;
+  }
+  buf_size = conn->ctx->io_buffer_size;
+  if ((buf = (char *) malloc((size_t) buf_size)) == NULL) {
+    cry(conn, "%s: cannot allocate %d bytes", __func__, buf_size);
+    return;
+  }
 
   while (len > 0) {
     // Calculate how much to read from the file in the buffer
-    to_read = sizeof(buf);
+    to_read = buf_size;
     if ((int64_t) to_read > len)
       to_read = (int) len;
 
     // Read from file, exit the loop on error
+    advise_sequential(fileno(fp), (int64_t) ftello(fp), buf_size);
     if ((num_read = fread(buf, 1, (size_t)to_read, fp)) == 0)
       break;
 
@@ -2495,30 +3365,285 @@ static void send_file_data(struct mg_connection *conn, FILE *fp, int64_t len) {
     conn->num_bytes_sent += num_written;
     len -= num_written;
   }
-}
 
-static int parse_range_header(const char *header, int64_t *a, int64_t *b) {
-  return sscanf(header, "bytes=%" INT64_FMT "-%" INT64_FMT, a, b);
+  free(buf);
 }
 
-static void gmt_time_string(char *buf, size_t buf_len, time_t *t) {
-  strftime(buf, buf_len, "%a, %d %b %Y %H:%M:%S GMT", gmtime(t));
+#if defined(USE_EPOLL)
+// Close the client socket of a finished transfer. Unlike
+// close_socket_gracefully(), this never lingers: the reactor thread
+// must not block, and all the data is already queued in the kernel.
+static void close_transfer_socket(SOCKET sock) {
+  char buf[BUFSIZ];
+
+  (void) shutdown(sock, SHUT_WR);
+  while (recv(sock, buf, sizeof(buf), 0) > 0) {
+    // Read and discard pending data, so close() does not reset the peer
+  }
+  (void) closesocket(sock);
 }
 
-static void handle_file_request(struct mg_connection *conn, const char *path,
-                                struct mgstat *stp, const char *filename) {
-  char date[64], lm[64], etag[64], range[64], filename_tag[256];
-  const char *msg = "OK", *hdr;
-  time_t curtime = time(NULL);
-  int64_t cl, r1, r2;
-  struct vec mime_vec;
-  FILE *fp;
-  int n;
+static void free_transfer(struct mg_context *ctx, struct transfer *t) {
+  (void) epoll_ctl(ctx->epoll_fd, EPOLL_CTL_DEL, t->sock, NULL);
+  close_transfer_socket(t->sock);
+  (void) close(t->fd);
 
-  get_mime_type(conn->ctx, path, &mime_vec);
-  cl = stp->size;
-  conn->request_info.status_code = 200;
-  range[0] = '\0';
+  // The transfer only leaves the list once its socket is closed, so that
+  // mg_wait_for_transfers() returns when the data is out
+  (void) pthread_mutex_lock(&ctx->mutex);
+  if (t->prev != NULL) {
+    t->prev->next = t->next;
+  } else {
+    ctx->transfers = t->next;
+  }
+  if (t->next != NULL) {
+    t->next->prev = t->prev;
+  }
+  if (--ctx->num_transfers == 0) {
+    (void) pthread_cond_broadcast(&ctx->transfers_done);
+  }
+  (void) pthread_mutex_unlock(&ctx->mutex);
+
+  free(t);
+}
+
+// Send as much of the transfer as the socket takes right now, but no more
+// than a few megabytes, so that one fast client cannot starve the others.
+// Return 1 if the transfer should wait for the next writability event,
+// 0 if it is complete or failed.
+static int transfer_step(struct transfer *t) {
+  char buf[BUFSIZ];
+  int64_t quota = 4 * 1024 * 1024;
+  ssize_t n;
+  size_t k;
+
+  while (t->remaining > 0 && quota > 0) {
+    k = t->remaining > quota ? (size_t) quota : (size_t) t->remaining;
+    advise_sequential(t->fd, t->offset, (int64_t) k);
+#if defined(USE_SENDFILE)
+    n = sendfile(t->sock, t->fd, &t->offset, k);
+#else
+    n = -1;
+    errno = EINVAL;
+#endif // USE_SENDFILE
+    if (n < 0 && ERRNO == EINVAL) {
+      // No sendfile(), or the file system does not support it, copy
+      // through user space
+      if (k > sizeof(buf)) {
+        k = sizeof(buf);
+      }
+      if ((n = pread(t->fd, buf, k, t->offset)) <= 0) {
+        return 0;
+      } else if ((n = send(t->sock, buf, (size_t) n, 0)) > 0) {
+        t->offset += n;
+      }
+    }
+
+    if (n < 0 && (ERRNO == EAGAIN || ERRNO == EWOULDBLOCK)) {
+      return 1;
+    } else if (n < 0 && ERRNO == EINTR) {
+      continue;
+    } else if (n <= 0) {
+      return 0;
+    }
+    t->remaining -= n;
+    quota -= n;
+  }
+
+  return t->remaining > 0;
+}
+
+// Hand the rest of the response body over to the reactor thread, if
+// enable_epoll is set and the connection is going to be closed after this
+// response. The worker thread is then free to serve the next connection.
+// Return 1 if the body has been offloaded, 0 if the caller must send it.
+static int offload_file_data(struct mg_connection *conn, FILE *fp,
+                             int64_t len) {
+  struct mg_context *ctx = conn->ctx;
+  struct epoll_event ev;
+  struct transfer *t;
+  int added;
+
+  if (ctx->epoll_fd == -1 ||
+      conn->ssl != NULL || conn->peer != NULL ||
+      should_keep_alive(conn) ||
+      (t = (struct transfer *) calloc(1, sizeof(*t))) == NULL) {
+    return 0;
+  }
+
+  t->sock = conn->client.sock;
+  t->offset = ftello(fp);
+  t->remaining = len;
+  if (t->offset < 0 || (t->fd = dup(fileno(fp))) < 0) {
+    free(t);
+    return 0;
+  }
+  set_close_on_exec(t->fd);
+#if defined(POSIX_FADV_SEQUENTIAL)
+  (void) posix_fadvise(t->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif // POSIX_FADV_SEQUENTIAL
+
+  // The reactor empties the list under the mutex when it stops, so checking
+  // stop_flag under it too means that no transfer is left behind. Once
+  // stopping, the caller sends the body itself, the socket still blocking.
+  (void) pthread_mutex_lock(&ctx->mutex);
+  if (ctx->stop_flag != 0) {
+    (void) pthread_mutex_unlock(&ctx->mutex);
+    (void) close(t->fd);
+    free(t);
+    return 0;
+  }
+  (void) set_non_blocking_mode(t->sock);
+  ev.events = EPOLLOUT;
+  ev.data.ptr = t;
+  added = epoll_ctl(ctx->epoll_fd, EPOLL_CTL_ADD, t->sock, &ev) == 0;
+  if (added) {
+    t->next = ctx->transfers;
+    if (t->next != NULL) {
+      t->next->prev = t;
+    }
+    ctx->transfers = t;
+    ctx->num_transfers++;
+  }
+  (void) pthread_mutex_unlock(&ctx->mutex);
+
+  // From now on the socket belongs to the transfer. The access log entry is
+  // written before the body is out, so account for the whole body upfront.
+  conn->client.sock = INVALID_SOCKET;
+  conn->num_bytes_sent += len;
+
+  if (!added) {
+    cry(conn, "%s: epoll_ctl: %s", __func__, strerror(ERRNO));
+    close_transfer_socket(t->sock);
+    (void) close(t->fd);
+    free(t);
+  }
+
+  return 1;
+}
+
+// Reactor thread multiplexes all offloaded transfers over one epoll set.
+static void reactor_thread(struct mg_context *ctx) {
+  struct epoll_event events[64];
+  struct thread_stats stats;
+  struct transfer *t;
+  int64_t remaining;
+  int i, n, more;
+
+  add_thread_stats(ctx, &stats);
+  while (ctx->stop_flag == 0) {
+    n = epoll_wait(ctx->epoll_fd, events, (int) ARRAY_SIZE(events), 200);
+    for (i = 0; i < n; i++) {
+      t = (struct transfer *) events[i].data.ptr;
+      remaining = t->remaining;
+      more = !(events[i].events & (EPOLLERR | EPOLLHUP)) && transfer_step(t);
+      stats.bytes_sent += remaining - t->remaining;
+      if (!more) {
+        free_transfer(ctx, t);
+      }
+    }
+  }
+  remove_thread_stats(ctx, &stats);
+
+  // Stop signal received, abort transfers that are still in flight. The list
+  // is found empty under the mutex, after which offload_file_data() sees
+  // stop_flag and adds no more.
+  (void) pthread_mutex_lock(&ctx->mutex);
+  while ((t = ctx->transfers) != NULL) {
+    (void) pthread_mutex_unlock(&ctx->mutex);
+    free_transfer(ctx, t);
+    (void) pthread_mutex_lock(&ctx->mutex);
+  }
+  ctx->num_threads--;
+  (void) pthread_cond_signal(&ctx->cond);
+  (void) pthread_mutex_unlock(&ctx->mutex);
+
+  DEBUG_TRACE(("exiting"));
+}
+#endif // USE_EPOLL
+
+static int parse_range_header(const char *header, int64_t *a, int64_t *b) {
+  return sscanf(header, "bytes=%" INT64_FMT "-%" INT64_FMT, a, b);
+}
+
+static void gmt_time_string(char *buf, size_t buf_len, time_t *t) {
+  strftime(buf, buf_len, "%a, %d %b %Y %H:%M:%S GMT", gmtime(t));
+}
+
+// Return the Date header value. It changes once a second, so it is only
+// formatted then. Each worker has its own conn, so the cache needs no lock.
+static const char *http_date(struct mg_connection *conn) {
+  time_t now = time(NULL);
+
+  if (now != conn->date_time) {
+    gmt_time_string(conn->date, sizeof(conn->date), &now);
+    conn->date_time = now;
+  }
+  return conn->date;
+}
+
+// Prepared headers of a file, see mg_prepare_file_headers()
+struct mg_file_headers {
+  char *path;
+  char *filename;     // Or NULL
+  int64_t size;       // What the headers were made for
+  time_t mtime;
+  char *fragment;     // Last-Modified up to Content-Type
+  int fragment_len;
+};
+
+// Format the headers of a file response that depend on the file only.
+// Return the length written into buf.
+static int format_file_headers(struct mg_connection *conn, const char *path,
+                               const struct mgstat *stp, const char *filename,
+                               char *buf, size_t buf_len) {
+  char lm[64], filename_tag[256];
+  time_t mtime = stp->mtime;
+  struct vec mime_vec;
+
+  get_mime_type(conn->ctx, path, &mime_vec);
+
+  // Last-Modified must be in UTC, according to
+  // http://www.w3.org/Protocols/rfc2616/rfc2616-sec3.html#sec3.3
+  gmt_time_string(lm, sizeof(lm), &mtime);
+
+  // Prepare the filename
+  if (filename)
+  {
+      char encoded_filename[256];
+      url_encode(filename, encoded_filename, sizeof(encoded_filename));
+      mg_snprintf(conn, filename_tag, sizeof(filename_tag),
+                  "Content-disposition: attachment; filename*=UTF-8''%s\r\n",
+                  encoded_filename);
+  }
+  else
+      filename_tag[0] = '\0';
+
+  return mg_snprintf(conn, buf, buf_len,
+      "Last-Modified: %s\r\n"
+      "Etag: \"%lx.%lx\"\r\n"
+      "%s"
+      "Content-Type: %.*s\r\n",
+      lm, (unsigned long) stp->mtime, (unsigned long) stp->size, filename_tag,
+      mime_vec.len, mime_vec.ptr);
+}
+
+// Send the file at path with the headers formatted by format_file_headers(),
+// and extra_headers if not NULL. Only the status, Date, the length, the
+// range and Connection are added here.
+static void send_file_with_headers(struct mg_connection *conn,
+                                   const char *path, const struct mgstat *stp,
+                                   const char *fragment, int fragment_len,
+                                   const char *extra_headers) {
+  char headers[BUFSIZ], range[64];
+  const char *msg = "OK", *hdr;
+  int64_t cl, r1, r2;
+  FILE *fp;
+  int n, len;
+
+  cl = stp->size;
+  conn->request_info.status_code = 200;
+  range[0] = '\0';
 
   if ((fp = mg_fopen(path, "rb")) == NULL) {
     send_http_error(conn, 500, http_500_error,
@@ -2529,7 +3654,7 @@ static void handle_file_request(struct mg_connection *conn, const char *path,
 
   // If Range: header specified, act accordingly
   r1 = r2 = 0;
-  hdr = mg_get_header(conn, "Range");
+  hdr = get_known_header(conn, HEADER_RANGE);
   if (hdr != NULL && (n = parse_range_header(hdr, &r1, &r2)) > 0) {
     conn->request_info.status_code = 206;
     (void) fseeko(fp, (off_t) r1, SEEK_SET);
@@ -2542,45 +3667,45 @@ static void handle_file_request(struct mg_connection *conn, const char *path,
     msg = "Partial Content";
   }
 
-  // Prepare Etag, Date, Last-Modified headers. Must be in UTC, according to
-  // http://www.w3.org/Protocols/rfc2616/rfc2616-sec3.html#sec3.3
-  gmt_time_string(date, sizeof(date), &curtime);
-  gmt_time_string(lm, sizeof(lm), &stp->mtime);
-  (void) mg_snprintf(conn, etag, sizeof(etag), "%lx.%lx",
-      (unsigned long) stp->mtime, (unsigned long) stp->size);
-
-  // Prepare the filename
-  if (filename)
-  {
-      char encoded_filename[256];
-      url_encode(filename, encoded_filename, sizeof(encoded_filename));
-      mg_snprintf(conn, filename_tag, sizeof(filename_tag),
-                  "Content-disposition: attachment; filename*=UTF-8''%s\r\n",
-                  encoded_filename);
-  }
-  else
-      filename_tag[0] = '\0';
-
-  (void) mg_printf(conn,
+  // The whole header block goes out in one write
+  len = mg_snprintf(conn, headers, sizeof(headers),
       "HTTP/1.1 %d %s\r\n"
-      "Date: %s\r\n"
-      "Last-Modified: %s\r\n"
-      "Etag: \"%s\"\r\n"
+      "Date: %s\r\n",
+      conn->request_info.status_code, msg, http_date(conn));
+  if (fragment_len < (int) sizeof(headers) - len) {
+    memcpy(headers + len, fragment, fragment_len);
+    len += fragment_len;
+  }
+  len += mg_snprintf(conn, headers + len, sizeof(headers) - len,
       "%s"
-      "Content-Type: %.*s\r\n"
       "Content-Length: %" INT64_FMT "\r\n"
       "Connection: %s\r\n"
       "Accept-Ranges: bytes\r\n"
       "%s\r\n",
-      conn->request_info.status_code, msg, date, lm, etag, filename_tag,
-      mime_vec.len, mime_vec.ptr, cl, suggest_connection_header(conn), range);
-
-  if (strcmp(conn->request_info.request_method, "HEAD") != 0) {
+      extra_headers == NULL ? "" : extra_headers, cl,
+      suggest_connection_header(conn), range);
+  (void) mg_write(conn, headers, len);
+
+  if (strcmp(conn->request_info.request_method, "HEAD") != 0
+#if defined(USE_EPOLL)
+      && !offload_file_data(conn, fp, cl)
+#endif // USE_EPOLL
+      ) {
     send_file_data(conn, fp, cl);
   }
   (void) fclose(fp);
 }
 
+static void handle_file_request(struct mg_connection *conn, const char *path,
+                                struct mgstat *stp, const char *filename) {
+  char fragment[1024];
+  int fragment_len;
+
+  fragment_len = format_file_headers(conn, path, stp, filename,
+                                     fragment, sizeof(fragment));
+  send_file_with_headers(conn, path, stp, fragment, fragment_len, NULL);
+}
+
 void mg_send_file(struct mg_connection *conn, const char *path, \
                   const char *filename) {
   struct mgstat st;
@@ -2591,11 +3716,72 @@ void mg_send_file(struct mg_connection *conn, const char *path, \
   }
 }
 
+struct mg_file_headers *mg_prepare_file_headers(struct mg_context *ctx,
+                                                const char *path,
+                                                const char *filename) {
+  struct mg_file_headers *headers;
+  char fragment[1024];
+  size_t path_len, filename_len;
+  struct mgstat st;
+  int fragment_len;
+
+  if (mg_stat(path, &st) != 0 || st.is_directory) {
+    return NULL;
+  }
+  fragment_len = format_file_headers(fc(ctx), path, &st, filename,
+                                     fragment, sizeof(fragment));
+
+  // The strings follow the structure in the same allocation
+  path_len = strlen(path) + 1;
+  filename_len = filename == NULL ? 0 : strlen(filename) + 1;
+  headers = (struct mg_file_headers *) malloc(sizeof(*headers) + path_len +
+      filename_len + fragment_len);
+  if (headers != NULL) {
+    headers->path = (char *) (headers + 1);
+    memcpy(headers->path, path, path_len);
+    headers->filename = NULL;
+    if (filename != NULL) {
+      headers->filename = headers->path + path_len;
+      memcpy(headers->filename, filename, filename_len);
+    }
+    headers->fragment = headers->path + path_len + filename_len;
+    memcpy(headers->fragment, fragment, fragment_len);
+    headers->fragment_len = fragment_len;
+    headers->size = st.size;
+    headers->mtime = st.mtime;
+  }
+
+  return headers;
+}
+
+void mg_send_prepared_file(struct mg_connection *conn,
+                           const struct mg_file_headers *headers,
+                           const char *extra_headers) {
+  struct mgstat st;
+
+  if (mg_stat(headers->path, &st) != 0) {
+    send_http_error(conn, 404, "Not Found", "%s", "File not found");
+  } else if (st.size != headers->size || st.mtime != headers->mtime) {
+    // Changed since, the Etag and Last-Modified must follow, and the extra
+    // headers may describe the old content
+    handle_file_request(conn, headers->path, &st, headers->filename);
+  } else {
+    send_file_with_headers(conn, headers->path, &st, headers->fragment,
+                           headers->fragment_len, extra_headers);
+  }
+}
+
+void mg_free_file_headers(struct mg_file_headers *headers) {
+  free(headers);
+}
+
 
 // Parse HTTP headers from the given buffer, advance buffer to the point
-// where parsing stopped.
-static void parse_http_headers(char **buf, struct mg_request_info *ri) {
-  int i;
+// where parsing stopped. If slots is not NULL, index the first occurrence
+// of each known header in it, slots must be zeroed by the caller.
+static void parse_http_headers(char **buf, struct mg_request_info *ri,
+                               unsigned char *slots) {
+  int i, id;
 
   for (i = 0; i < (int) ARRAY_SIZE(ri->http_headers); i++) {
     ri->http_headers[i].name = skip_quoted(buf, ":", " ", 0);
@@ -2603,18 +3789,28 @@ static void parse_http_headers(char **buf, struct mg_request_info *ri) {
     if (ri->http_headers[i].name[0] == '\0')
       break;
     ri->num_headers = i + 1;
+    if (slots != NULL && (id = known_header_id(ri->http_headers[i].name)) >= 0 &&
+        slots[id] == 0) {
+      slots[id] = (unsigned char) (i + 1);
+    }
   }
 }
 
 static int is_valid_http_method(const char *method) {
-  return !strcmp(method, "GET") || !strcmp(method, "POST") ||
-    !strcmp(method, "HEAD") || !strcmp(method, "CONNECT") ||
-    !strcmp(method, "PUT") || !strcmp(method, "DELETE") ||
-    !strcmp(method, "OPTIONS") || !strcmp(method, "PROPFIND");
+  switch (strlen(method)) {
+    case 3: return !memcmp(method, "GET", 3) || !memcmp(method, "PUT", 3);
+    case 4: return !memcmp(method, "POST", 4) || !memcmp(method, "HEAD", 4);
+    case 6: return !memcmp(method, "DELETE", 6);
+    case 7: return !memcmp(method, "CONNECT", 7) ||
+                   !memcmp(method, "OPTIONS", 7);
+    case 8: return !memcmp(method, "PROPFIND", 8);
+    default: return 0;
+  }
 }
 
-// Parse HTTP request, fill in mg_request_info structure.
-static int parse_http_request(char *buf, struct mg_request_info *ri) {
+// Parse HTTP request, fill in mg_request_info structure and the header slots.
+static int parse_http_request(char *buf, struct mg_request_info *ri,
+                              unsigned char *slots) {
   int status = 0;
 
   // RFC says that all initial whitespaces should be ingored
@@ -2629,7 +3825,7 @@ static int parse_http_request(char *buf, struct mg_request_info *ri) {
   if (is_valid_http_method(ri->request_method) &&
       strncmp(ri->http_version, "HTTP/", 5) == 0) {
     ri->http_version += 5;   // Skip "HTTP/"
-    parse_http_headers(&buf, ri);
+    parse_http_headers(&buf, ri, slots);
     status = 1;
   }
 
@@ -2709,7 +3905,7 @@ static int substitute_index_file(struct mg_connection *conn, char *path,
 // Return True if we should reply 304 Not Modified.
 static int is_not_modified(const struct mg_connection *conn,
                            const struct mgstat *stp) {
-  const char *ims = mg_get_header(conn, "If-Modified-Since");
+  const char *ims = get_known_header(conn, HEADER_IF_MODIFIED_SINCE);
   return ims != NULL && stp->mtime <= parse_date_string(ims);
 }
 
@@ -2863,7 +4059,7 @@ static void prepare_cgi_environment(struct mg_connection *conn,
   if (conn->request_info.query_string != NULL)
     addenv(blk, "QUERY_STRING=%s", conn->request_info.query_string);
 
-  if ((s = mg_get_header(conn, "Content-Length")) != NULL)
+  if ((s = get_known_header(conn, HEADER_CONTENT_LENGTH)) != NULL)
     addenv(blk, "CONTENT_LENGTH=%s", s);
 
   if ((s = getenv("PATH")) != NULL)
@@ -2985,7 +4181,7 @@ static void handle_cgi_request(struct mg_connection *conn, const char *prog) {
   }
   pbuf = buf;
   buf[headers_len - 1] = '\0';
-  parse_http_headers(&pbuf, &ri);
+  parse_http_headers(&pbuf, &ri, NULL);
 
   // Make up and send the status line
   if ((status = get_header(&ri, "Status")) != NULL) {
@@ -3142,7 +4338,7 @@ static void do_ssi_include(struct mg_connection *conn, const char *ssi,
         tag, path, strerror(ERRNO));
   } else {
     set_close_on_exec(fileno(fp));
-    is_ssi = match_extension(path, conn->ctx->config[SSI_EXTENSIONS]);
+    is_ssi = match_extension(path, conn->ctx->ssi_extensions);
     if (is_ssi) {
       send_ssi_file(conn, path, fp, include_level + 1);
     } else {
@@ -3308,7 +4504,7 @@ static void handle_propfind(struct mg_connection *conn, const char* path,
 
   // If it is a directory, print directory entries too if Depth is not 0
   if (st->is_directory &&
-      !mg_strcasecmp(conn->ctx->config[ENABLE_DIRECTORY_LISTING], "yes") &&
+      conn->ctx->enable_directory_listing &&
       (depth == NULL || strcmp(depth, "0") != 0)) {
     scan_directory(conn, path, conn, &print_dav_dir_entry);
   }
@@ -3370,14 +4566,14 @@ static void handle_request(struct mg_connection *conn) {
     handle_propfind(conn, path, &st);
   } else if (st.is_directory &&
              !substitute_index_file(conn, path, sizeof(path), &st)) {
-    if (!mg_strcasecmp(conn->ctx->config[ENABLE_DIRECTORY_LISTING], "yes")) {
+    if (conn->ctx->enable_directory_listing) {
       handle_directory_request(conn, path);
     } else {
       send_http_error(conn, 403, "Directory Listing Denied",
           "Directory listing denied");
     }
 #if !defined(NO_CGI)
-  } else if (match_extension(path, conn->ctx->config[CGI_EXTENSIONS])) {
+  } else if (match_extension(path, conn->ctx->cgi_extensions)) {
     if (strcmp(ri->request_method, "POST") &&
         strcmp(ri->request_method, "GET")) {
       send_http_error(conn, 501, "Not Implemented",
@@ -3386,7 +4582,7 @@ static void handle_request(struct mg_connection *conn) {
       handle_cgi_request(conn, path);
     }
 #endif // !NO_CGI
-  } else if (match_extension(path, conn->ctx->config[SSI_EXTENSIONS])) {
+  } else if (match_extension(path, conn->ctx->ssi_extensions)) {
     handle_ssi_file_request(conn, path);
   } else if (is_not_modified(conn, &st)) {
     send_http_error(conn, 304, "Not Modified", "");
@@ -3395,17 +4591,100 @@ static void handle_request(struct mg_connection *conn) {
   }
 }
 
+static int is_unix_socket(const struct socket *sp) {
+#if !defined(_WIN32)
+  return sp->lsa.u.sa.sa_family == AF_UNIX;
+#else
+  (void) sp;
+  return 0;
+#endif // !_WIN32
+}
+
 static void close_all_listening_sockets(struct mg_context *ctx) {
   struct socket *sp, *tmp;
   for (sp = ctx->listening_sockets; sp != NULL; sp = tmp) {
     tmp = sp->next;
     (void) closesocket(sp->sock);
+#if !defined(_WIN32)
+    if (is_unix_socket(sp)) {
+      (void) unlink(sp->lsa.u.un.sun_path);
+    }
+#endif // !_WIN32
     free(sp);
   }
 }
 
+#if !defined(_WIN32)
+// Remove the socket file left behind by a server that is gone. A live
+// server still accepts connections, keep its socket so that bind() fails.
+static void remove_stale_unix_socket(const struct usa *usa) {
+  struct stat st;
+  SOCKET sock;
+  int alive;
+
+  if (stat(usa->u.un.sun_path, &st) != 0 || !S_ISSOCK(st.st_mode) ||
+      (sock = socket(PF_UNIX, SOCK_STREAM, 0)) == INVALID_SOCKET) {
+    return;
+  }
+  alive = connect(sock, &usa->u.sa, usa->len) == 0 || ERRNO != ECONNREFUSED;
+  (void) closesocket(sock);
+  if (!alive) {
+    (void) unlink(usa->u.un.sun_path);
+  }
+}
+#endif // !_WIN32
+
+// Create a listening socket for the address, or return INVALID_SOCKET.
+static SOCKET open_listening_socket(const struct socket *so) {
+  int on = 1;
+  SOCKET sock;
+
+#if !defined(_WIN32)
+  if (is_unix_socket(so)) {
+    // Only the owner may talk to a control socket
+    remove_stale_unix_socket(&so->lsa);
+    if ((sock = socket(PF_UNIX, SOCK_STREAM, 0)) == INVALID_SOCKET ||
+        bind(sock, &so->lsa.u.sa, so->lsa.len) != 0 ||
+        chmod(so->lsa.u.un.sun_path, 0600) != 0 ||
+        listen(sock, 100) != 0) {
+      if (sock != INVALID_SOCKET) {
+        closesocket(sock);
+      }
+      return INVALID_SOCKET;
+    }
+    return sock;
+  }
+#endif // !_WIN32
+
+  if ((sock = socket(PF_INET, SOCK_STREAM, 6)) == INVALID_SOCKET ||
+#if !defined(_WIN32)
+      // On Windows, SO_REUSEADDR is recommended only for
+      // broadcast UDP sockets
+      setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+#endif // !_WIN32
+      // Set TCP keep-alive. This is needed because if HTTP-level
+      // keep-alive is enabled, and client resets the connection,
+      // server won't get TCP FIN or RST and will keep the connection
+      // open forever. With TCP keep-alive, next keep-alive
+      // handshake will figure out that the client is down and
+      // will close the server end.
+      // Thanks to Igor Klopov who suggested the patch.
+      setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, (void *) &on,
+                 sizeof(on)) != 0 ||
+      bind(sock, &so->lsa.u.sa, so->lsa.len) != 0 ||
+      listen(sock, 100) != 0) {
+    if (sock != INVALID_SOCKET) {
+      closesocket(sock);
+    }
+    return INVALID_SOCKET;
+  }
+
+  return sock;
+}
+
 // Valid listening port specification is: [ip_address:]port[s|p]
 // Examples: 80, 443s, 127.0.0.1:3128p, 1.2.3.4:8080sp
+// On UNIX, unix:/path/to/socket listens on a Unix-domain socket instead.
 static int parse_port_string(const struct vec *vec, struct socket *so) {
   struct usa *usa = &so->lsa;
   int a, b, c, d, port, len;
@@ -3413,6 +4692,18 @@ static int parse_port_string(const struct vec *vec, struct socket *so) {
   // MacOS needs that. If we do not zero it, subsequent bind() will fail.
   memset(so, 0, sizeof(*so));
 
+#if !defined(_WIN32)
+  if (vec->len > 5 && !memcmp(vec->ptr, "unix:", 5)) {
+    if (vec->len - 5 >= sizeof(usa->u.un.sun_path)) {
+      return 0;
+    }
+    usa->u.un.sun_family = AF_UNIX;
+    memcpy(usa->u.un.sun_path, vec->ptr + 5, vec->len - 5);
+    usa->len = sizeof(usa->u.un);
+    return 1;
+  }
+#endif // !_WIN32
+
   if (sscanf(vec->ptr, "%d.%d.%d.%d:%d%n", &a, &b, &c, &d, &port, &len) == 5) {
     // IP address to bind to is specified
     usa->u.sin.sin_addr.s_addr = htonl((a << 24) | (b << 16) | (c << 8) | d);
@@ -3439,7 +4730,7 @@ static int parse_port_string(const struct vec *vec, struct socket *so) {
 
 static int set_ports_option(struct mg_context *ctx) {
   const char *list = ctx->config[LISTENING_PORTS];
-  int on = 1, success = 1;
+  int success = 1;
   SOCKET sock;
   struct vec vec;
   struct socket so, *listener;
@@ -3452,25 +4743,7 @@ static int set_ports_option(struct mg_context *ctx) {
     } else if (so.is_ssl && ctx->ssl_ctx == NULL) {
       cry(fc(ctx), "Cannot add SSL socket, is -ssl_certificate option set?");
       success = 0;
-    } else if ((sock = socket(PF_INET, SOCK_STREAM, 6)) == INVALID_SOCKET ||
-#if !defined(_WIN32)
-               // On Windows, SO_REUSEADDR is recommended only for
-               // broadcast UDP sockets
-               setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on,
-                          sizeof(on)) != 0 ||
-#endif // !_WIN32
-               // Set TCP keep-alive. This is needed because if HTTP-level
-               // keep-alive is enabled, and client resets the connection,
-               // server won't get TCP FIN or RST and will keep the connection
-               // open forever. With TCP keep-alive, next keep-alive
-               // handshake will figure out that the client is down and
-               // will close the server end.
-               // Thanks to Igor Klopov who suggested the patch.
-               setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, (void *) &on,
-                          sizeof(on)) != 0 ||
-               bind(sock, &so.lsa.u.sa, so.lsa.len) != 0 ||
-               listen(sock, 100) != 0) {
-      closesocket(sock);
+    } else if ((sock = open_listening_socket(&so)) == INVALID_SOCKET) {
       cry(fc(ctx), "%s: cannot bind to %.*s: %s", __func__,
           vec.len, vec.ptr, strerror(ERRNO));
       success = 0;
@@ -3495,36 +4768,49 @@ static int set_ports_option(struct mg_context *ctx) {
   return success;
 }
 
-static void log_header(const struct mg_connection *conn, const char *header,
-                       FILE *fp) {
+static void waitq_wake(struct waitq *q, int n);
+
+// Return the length of the header value as it goes into the access log.
+static int log_header(const struct mg_connection *conn, enum known_header id,
+                      char *buf, size_t buf_len) {
   const char *header_value;
 
-  if ((header_value = mg_get_header(conn, header)) == NULL) {
-    (void) fprintf(fp, "%s", " -");
+  if ((header_value = get_known_header(conn, id)) == NULL) {
+    return snprintf(buf, buf_len, "%s", " -");
   } else {
-    (void) fprintf(fp, " \"%s\"", header_value);
+    return snprintf(buf, buf_len, " \"%s\"", header_value);
   }
 }
 
+// Format the access log line into the worker's ring. This never blocks:
+// if the logger thread fell behind, the record is dropped and counted.
 static void log_access(const struct mg_connection *conn) {
   const struct mg_request_info *ri;
-  FILE *fp;
-  char date[64];
+  struct log_ring *ring = conn->log_ring;
+  unsigned int head, used;
+  char date[64], *buf;
+  size_t len;
+  int n;
 
-  fp = conn->ctx->config[ACCESS_LOG_FILE] == NULL ?  NULL :
-    mg_fopen(conn->ctx->config[ACCESS_LOG_FILE], "a+");
+  if (ring == NULL)
+    return;
 
-  if (fp == NULL)
+  head = ring->head;
+  used = head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  if (used >= LOG_RING_SIZE) {
+    (void) __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+    waitq_wake(&conn->ctx->log_wakeup, 1);
     return;
+  }
 
   (void) strftime(date, sizeof(date), "%d/%b/%Y:%H:%M:%S %z",
       localtime(&conn->birth_time));
 
   ri = &conn->request_info;
+  buf = ring->records[head & (LOG_RING_SIZE - 1)];
 
-  flockfile(fp);
-
-  (void) fprintf(fp,
+  // Keep a byte for the newline. Lines that don't fit are truncated.
+  n = snprintf(buf, LOG_RECORD_SIZE - 1,
       "%s - %s [%s] \"%s %s HTTP/%s\" %d %" INT64_FMT,
       inet_ntoa(conn->client.rsa.u.sin.sin_addr),
       ri->remote_user == NULL ? "-" : ri->remote_user,
@@ -3533,13 +4819,27 @@ static void log_access(const struct mg_connection *conn) {
       ri->uri ? ri->uri : "-",
       ri->http_version,
       conn->request_info.status_code, conn->num_bytes_sent);
-  log_header(conn, "Referer", fp);
-  log_header(conn, "User-Agent", fp);
-  (void) fputc('\n', fp);
-  (void) fflush(fp);
+  len = n < 0 ? LOG_RECORD_SIZE : (size_t) n;
+  if (len < LOG_RECORD_SIZE - 2) {
+    n = log_header(conn, HEADER_REFERER, buf + len, LOG_RECORD_SIZE - 1 - len);
+    len += n < 0 ? LOG_RECORD_SIZE : (size_t) n;
+  }
+  if (len < LOG_RECORD_SIZE - 2) {
+    n = log_header(conn, HEADER_USER_AGENT, buf + len, LOG_RECORD_SIZE - 1 - len);
+    len += n < 0 ? LOG_RECORD_SIZE : (size_t) n;
+  }
+  if (len > LOG_RECORD_SIZE - 2) {
+    len = LOG_RECORD_SIZE - 2;
+  }
+  buf[len] = '\n';
+  buf[len + 1] = '\0';
 
-  funlockfile(fp);
-  (void) fclose(fp);
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+  // Don't wait for the flush interval if the ring is filling up
+  if (used + 1 >= LOG_RING_SIZE / 2) {
+    waitq_wake(&conn->ctx->log_wakeup, 1);
+  }
 }
 
 static int isbyte(int n) {
@@ -3765,6 +5065,17 @@ static int set_gpass_option(struct mg_context *ctx) {
   return path == NULL || mg_stat(path, &mgstat) == 0;
 }
 
+static int set_extensions_option(struct mg_context *ctx) {
+  if ((ctx->cgi_extensions =
+       compile_extension_list(ctx->config[CGI_EXTENSIONS])) == NULL ||
+      (ctx->ssi_extensions =
+       compile_extension_list(ctx->config[SSI_EXTENSIONS])) == NULL) {
+    cry(fc(ctx), "%s: cannot allocate extension lists", __func__);
+    return 0;
+  }
+  return 1;
+}
+
 static int set_acl_option(struct mg_context *ctx) {
   struct usa fake;
   return check_acl(ctx, &fake) != -1;
@@ -3780,6 +5091,7 @@ static void reset_per_request_attributes(struct mg_connection *conn) {
   ri->remote_user = ri->request_method = ri->uri = ri->http_version = NULL;
   ri->num_headers = 0;
   ri->status_code = -1;
+  memset(conn->header_slots, 0, sizeof(conn->header_slots));
 
   conn->num_bytes_sent = conn->consumed_content = 0;
   conn->content_len = -1;
@@ -3925,7 +5237,7 @@ static void process_new_connection(struct mg_connection *conn) {
   int keep_alive_enabled;
   const char *cl;
 
-  keep_alive_enabled = !strcmp(conn->ctx->config[ENABLE_KEEP_ALIVE], "yes");
+  keep_alive_enabled = conn->ctx->enable_keep_alive;
 
   do {
     reset_per_request_attributes(conn);
@@ -3945,7 +5257,7 @@ static void process_new_connection(struct mg_connection *conn) {
 
     // Nul-terminate the request cause parse_http_request() uses sscanf
     conn->buf[conn->request_len - 1] = '\0';
-    if (!parse_http_request(conn->buf, ri) ||
+    if (!parse_http_request(conn->buf, ri, conn->header_slots) ||
         (!conn->client.is_proxy && !is_valid_uri(ri->uri))) {
       // Do not put garbage in the access log, just send it back to the client
       send_http_error(conn, 400, "Bad Request",
@@ -3955,9 +5267,10 @@ static void process_new_connection(struct mg_connection *conn) {
       // Request seems valid, but HTTP version is strange
       send_http_error(conn, 505, "HTTP version not supported", "");
       log_access(conn);
+      conn->stats.requests++;
     } else {
       // Request is valid, handle it
-      cl = get_header(ri, "Content-Length");
+      cl = get_known_header(conn, HEADER_CONTENT_LENGTH);
       conn->content_len = cl == NULL ? -1 : strtoll(cl, NULL, 10);
       conn->birth_time = time(NULL);
       if (conn->client.is_proxy) {
@@ -3966,6 +5279,7 @@ static void process_new_connection(struct mg_connection *conn) {
         handle_request(conn);
       }
       log_access(conn);
+      conn->stats.requests++;
       discard_current_request_from_buffer(conn);
     }
     // conn->peer is not NULL only for SSL-ed proxy connections
@@ -3973,50 +5287,488 @@ static void process_new_connection(struct mg_connection *conn) {
            (conn->peer || (keep_alive_enabled && should_keep_alive(conn))));
 }
 
-// Worker threads take accepted socket from the queue
-static int consume_socket(struct mg_context *ctx, struct socket *sp) {
+static void waitq_init(struct waitq *q) {
+  q->seq = q->waiters = 0;
+#if !defined(USE_FUTEX)
+  (void) pthread_mutex_init(&q->mutex, NULL);
+  (void) pthread_cond_init(&q->cond, NULL);
+#endif // !USE_FUTEX
+}
+
+static void waitq_destroy(struct waitq *q) {
+#if !defined(USE_FUTEX)
+  (void) pthread_mutex_destroy(&q->mutex);
+  (void) pthread_cond_destroy(&q->cond);
+#else
+  (void) q;
+#endif // !USE_FUTEX
+}
+
+// Register as a waiter. Return the counter value to pass to waitq_wait().
+// The caller must re-check its condition after this, and either call
+// waitq_wait() or waitq_cancel().
+static int waitq_prepare(struct waitq *q) {
+  (void) __atomic_add_fetch(&q->waiters, 1, __ATOMIC_SEQ_CST);
+  return __atomic_load_n(&q->seq, __ATOMIC_SEQ_CST);
+}
+
+static void waitq_cancel(struct waitq *q) {
+  (void) __atomic_sub_fetch(&q->waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+#if !defined(USE_FUTEX)
+// Wait on the condition variable for at most timeout_ms milliseconds.
+static void cond_wait_ms(pthread_cond_t *cv, pthread_mutex_t *mutex,
+                         int timeout_ms) {
+#if defined(_WIN32)
+  HANDLE handles[] = {cv->signal, cv->broadcast};
+  ReleaseMutex(*mutex);
+  WaitForMultipleObjects(2, handles, FALSE, (DWORD) timeout_ms);
+  (void) WaitForSingleObject(*mutex, INFINITE);
+#else
+  struct timeval now;
+  struct timespec abstime;
+
+  (void) gettimeofday(&now, NULL);
+  abstime.tv_sec = now.tv_sec + timeout_ms / 1000;
+  abstime.tv_nsec = now.tv_usec * 1000L + (timeout_ms % 1000) * 1000000L;
+  if (abstime.tv_nsec >= 1000000000L) {
+    abstime.tv_sec++;
+    abstime.tv_nsec -= 1000000000L;
+  }
+  (void) pthread_cond_timedwait(cv, mutex, &abstime);
+#endif // _WIN32
+}
+#endif // !USE_FUTEX
+
+// Sleep until the counter moves away from seq, or for at most timeout_ms
+// milliseconds if that is not negative. Return 0 if the time ran out.
+static int waitq_wait(struct waitq *q, int seq, int timeout_ms) {
+#if defined(USE_FUTEX)
+  struct timespec ts, *tsp = NULL;
+
+  if (timeout_ms >= 0) {
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+    tsp = &ts;
+  }
+  (void) syscall(SYS_futex, &q->seq, FUTEX_WAIT_PRIVATE, seq, tsp, NULL, 0);
+#else
+  (void) pthread_mutex_lock(&q->mutex);
+  if (timeout_ms < 0) {
+    while (q->seq == seq) {
+      (void) pthread_cond_wait(&q->cond, &q->mutex);
+    }
+  } else if (q->seq == seq) {
+    cond_wait_ms(&q->cond, &q->mutex, timeout_ms);
+  }
+  (void) pthread_mutex_unlock(&q->mutex);
+#endif // USE_FUTEX
+  waitq_cancel(q);
+
+  return __atomic_load_n(&q->seq, __ATOMIC_SEQ_CST) != seq;
+}
+
+// Wake up to n parked threads, or all of them if n is INT_MAX. This is
+// just an atomic load if nobody is waiting.
+static void waitq_wake(struct waitq *q, int n) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&q->waiters, __ATOMIC_SEQ_CST) == 0) {
+    return;
+  }
+#if defined(USE_FUTEX)
+  (void) __atomic_add_fetch(&q->seq, 1, __ATOMIC_SEQ_CST);
+  (void) syscall(SYS_futex, &q->seq, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+#else
+  (void) pthread_mutex_lock(&q->mutex);
+  q->seq++;
+  if (n == INT_MAX) {
+    (void) pthread_cond_broadcast(&q->cond);
+  } else {
+    (void) pthread_cond_signal(&q->cond);
+  }
+  (void) pthread_mutex_unlock(&q->mutex);
+#endif // USE_FUTEX
+}
+
+// Give the calling worker a ring for its access log records. Without one,
+// its requests simply go unlogged.
+static struct log_ring *add_log_ring(struct mg_context *ctx) {
+  struct log_ring *ring;
+
+  if (!ctx->log_enabled ||
+      (ring = (struct log_ring *) calloc(1, sizeof(*ring))) == NULL) {
+    return NULL;
+  }
+  (void) pthread_mutex_lock(&ctx->log_mutex);
+  ring->next = ctx->log_rings;
+  ctx->log_rings = ring;
+  (void) pthread_mutex_unlock(&ctx->log_mutex);
+
+  return ring;
+}
+
+// The worker is exiting, the logger thread frees the ring once it's empty.
+static void retire_log_ring(struct mg_context *ctx, struct log_ring *ring) {
+  if (ring != NULL) {
+    __atomic_store_n(&ring->retired, 1, __ATOMIC_RELEASE);
+    waitq_wake(&ctx->log_wakeup, 1);
+  }
+}
+
+// Write out everything the workers have logged so far, batch_size bytes
+// at a time, and free the rings of the workers that are gone.
+static void flush_access_log(struct mg_context *ctx) {
+  struct log_ring *ring, *next, **link;
+  unsigned int head, tail, dropped = 0;
+  FILE *fp = NULL;
+  int retired;
+
+  (void) pthread_mutex_lock(&ctx->log_mutex);
+  ring = ctx->log_rings;
+  (void) pthread_mutex_unlock(&ctx->log_mutex);
+
+  // Workers only ever prepend to the list, and only this thread removes
+  // from it, so the walk itself needs no lock
+  for (; ring != NULL; ring = next) {
+    next = ring->next;
+    retired = __atomic_load_n(&ring->retired, __ATOMIC_ACQUIRE);
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    tail = ring->tail;
+
+    if (tail != head && fp == NULL &&
+        (fp = mg_fopen(ctx->config[ACCESS_LOG_FILE], "a+")) != NULL) {
+      (void) setvbuf(fp, NULL, _IOFBF, (size_t) ctx->log_batch_size);
+    }
+    for (; tail != head; tail++) {
+      if (fp != NULL) {
+        (void) fputs(ring->records[tail & (LOG_RING_SIZE - 1)], fp);
+      }
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    dropped += __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+
+    if (retired) {
+      (void) pthread_mutex_lock(&ctx->log_mutex);
+      for (link = &ctx->log_rings; *link != ring; link = &(*link)->next)
+        ;
+      *link = ring->next;
+      (void) pthread_mutex_unlock(&ctx->log_mutex);
+      free(ring);
+    }
+  }
+
+  if (fp != NULL) {
+    (void) fclose(fp);
+  }
+  if (dropped > 0) {
+    ctx->log_dropped += dropped;
+    cry(fc(ctx), "access log: dropped %u records, %u in total",
+        dropped, ctx->log_dropped);
+  }
+}
+
+// Logger thread flushes the access log every access_log_flush_interval_ms,
+// or sooner when a worker's ring is half full. It keeps going until the
+// last worker has retired its ring, so that no record is lost on mg_stop().
+static void logger_thread(struct mg_context *ctx) {
+  int seq, done;
+
+  do {
+    done = ctx->stop_flag != 0 &&
+      __atomic_load_n(&ctx->num_workers, __ATOMIC_SEQ_CST) == 0;
+    if (done) {
+      // Workers leave the pool before they retire their rings
+      (void) pthread_mutex_lock(&ctx->log_mutex);
+      done = ctx->log_rings == NULL;
+      (void) pthread_mutex_unlock(&ctx->log_mutex);
+    }
+    seq = waitq_prepare(&ctx->log_wakeup);
+    flush_access_log(ctx);
+    if (done) {
+      waitq_cancel(&ctx->log_wakeup);
+    } else {
+      (void) waitq_wait(&ctx->log_wakeup, seq, ctx->log_flush_ms);
+    }
+  } while (!done);
+
   (void) pthread_mutex_lock(&ctx->mutex);
-  DEBUG_TRACE(("going idle"));
+  ctx->num_threads--;
+  (void) pthread_cond_signal(&ctx->cond);
+  (void) pthread_mutex_unlock(&ctx->mutex);
+
+  DEBUG_TRACE(("exiting"));
+}
+
+// Allocate the ring of accepted sockets, capacity rounded up to a power of
+// two. Every slot starts out free for the producer at the same position.
+static int init_socket_queue(struct mg_context *ctx) {
+  unsigned int i, size = 1;
+  int requested = atoi(ctx->config[SOCKET_QUEUE_SIZE]);
+
+  while ((int) size < requested && size < (1U << 20)) {
+    size <<= 1;
+  }
+  if ((ctx->queue = (struct sq_slot *) calloc(size,
+          sizeof(ctx->queue[0]))) == NULL) {
+    cry(fc(ctx), "%s: cannot allocate socket queue", __func__);
+    return 0;
+  }
+  for (i = 0; i < size; i++) {
+    ctx->queue[i].seq = i;
+  }
+  ctx->sq_size = size;
+  waitq_init(&ctx->sq_not_empty);
+  waitq_init(&ctx->sq_not_full);
+
+  return 1;
+}
+
+// Try to put the socket into the ring. Return 0 if the ring is full.
+// Bounded multi-producer/multi-consumer queue, after Dmitry Vyukov's design.
+static int sq_push(struct mg_context *ctx, const struct socket *sp) {
+  struct sq_slot *slot;
+  unsigned int pos, seq;
+  int diff;
+
+  pos = __atomic_load_n(&ctx->sq_head, __ATOMIC_RELAXED);
+  for (;;) {
+    slot = &ctx->queue[pos & (ctx->sq_size - 1)];
+    seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    diff = (int) (seq - pos);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&ctx->sq_head, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (diff < 0) {
+      return 0;  // Slot still holds a socket from the previous lap
+    } else {
+      pos = __atomic_load_n(&ctx->sq_head, __ATOMIC_RELAXED);
+    }
+  }
+
+  slot->socket = *sp;
+  __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+  return 1;
+}
 
-  // If the queue is empty, wait. We're idle at this point.
-  while (ctx->sq_head == ctx->sq_tail && ctx->stop_flag == 0) {
-    pthread_cond_wait(&ctx->sq_full, &ctx->mutex);
+// Try to take a socket from the ring. Return 0 if the ring is empty.
+static int sq_pop(struct mg_context *ctx, struct socket *sp) {
+  struct sq_slot *slot;
+  unsigned int pos, seq;
+  int diff;
+
+  pos = __atomic_load_n(&ctx->sq_tail, __ATOMIC_RELAXED);
+  for (;;) {
+    slot = &ctx->queue[pos & (ctx->sq_size - 1)];
+    seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    diff = (int) (seq - (pos + 1));
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&ctx->sq_tail, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (diff < 0) {
+      return 0;  // Slot not produced yet
+    } else {
+      pos = __atomic_load_n(&ctx->sq_tail, __ATOMIC_RELAXED);
+    }
   }
 
-  // If we're stopping, sq_head may be equal to sq_tail.
-  if (ctx->sq_head > ctx->sq_tail) {
-    // Copy socket from the queue and increment tail
-    *sp = ctx->queue[ctx->sq_tail % ARRAY_SIZE(ctx->queue)];
-    ctx->sq_tail++;
-    DEBUG_TRACE(("grabbed socket %d, going busy", sp->sock));
+  *sp = slot->socket;
+  __atomic_store_n(&slot->seq, pos + ctx->sq_size, __ATOMIC_RELEASE);
+
+  return 1;
+}
+
+// Number of accepted sockets waiting for a worker.
+static int sq_depth(const struct mg_context *ctx) {
+  unsigned int head = __atomic_load_n(&ctx->sq_head, __ATOMIC_RELAXED);
+  unsigned int tail = __atomic_load_n(&ctx->sq_tail, __ATOMIC_RELAXED);
+  return (int) (head - tail) < 0 ? 0 : (int) (head - tail);
+}
+
+static void worker_thread(struct mg_context *ctx);
 
-    // Wrap pointers if needed
-    while (ctx->sq_tail > (int) ARRAY_SIZE(ctx->queue)) {
-      ctx->sq_tail -= ARRAY_SIZE(ctx->queue);
-      ctx->sq_head -= ARRAY_SIZE(ctx->queue);
+// Start another worker if there are more sockets queued than idle workers
+// to take them, unless the pool is at max_threads already.
+static void grow_pool(struct mg_context *ctx) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (ctx->num_workers >= ctx->max_threads ||
+      sq_depth(ctx) <= __atomic_load_n(&ctx->idle_workers, __ATOMIC_SEQ_CST)) {
+    return;
+  }
+
+  (void) pthread_mutex_lock(&ctx->mutex);
+  if (ctx->stop_flag == 0 && ctx->num_workers < ctx->max_threads) {
+    if (start_thread(ctx, (mg_thread_func_t) worker_thread, ctx) != 0) {
+      cry(fc(ctx), "Cannot start worker thread: %d", ERRNO);
+    } else {
+      ctx->num_workers++;
+      ctx->num_threads++;
+      DEBUG_TRACE(("pool grew to %d workers", ctx->num_workers));
     }
   }
+  (void) pthread_mutex_unlock(&ctx->mutex);
+}
+
+// Take the calling worker out of the pool. Return 0 if it has to stay
+// because the pool would drop below min_threads.
+static int leave_pool(struct mg_context *ctx) {
+  int left = 0;
 
-  (void) pthread_cond_signal(&ctx->sq_empty);
+  (void) pthread_mutex_lock(&ctx->mutex);
+  if (ctx->stop_flag != 0 || ctx->num_workers > ctx->min_threads) {
+    ctx->num_workers--;
+    left = 1;
+  }
   (void) pthread_mutex_unlock(&ctx->mutex);
 
-  return !ctx->stop_flag;
+  return left;
+}
+
+#if !defined(_WIN32)
+// Read a number from a file, return -1 if that fails.
+static long read_long(const char *path) {
+  FILE *fp;
+  long value = -1;
+
+  if ((fp = fopen(path, "r")) != NULL) {
+    if (fscanf(fp, "%ld", &value) != 1) {
+      value = -1;
+    }
+    (void) fclose(fp);
+  }
+
+  return value;
+}
+#endif // !_WIN32
+
+// Number of CPUs this process may use, taking a cgroup CPU quota into
+// account, so that a container limited to 2 CPUs on a 64-core host does
+// not start 64 workers.
+static int get_num_cpus(void) {
+  int num_cpus = 1;
+#if defined(_WIN32)
+  SYSTEM_INFO si;
+
+  GetSystemInfo(&si);
+  num_cpus = (int) si.dwNumberOfProcessors;
+#else
+  FILE *fp;
+  char quota[32];
+  long period, n;
+
+#if defined(_SC_NPROCESSORS_ONLN)
+  num_cpus = (int) sysconf(_SC_NPROCESSORS_ONLN);
+#endif // _SC_NPROCESSORS_ONLN
+
+  // cgroup v2 has "<quota> <period>" or "max <period>" in one file
+  if ((fp = fopen("/sys/fs/cgroup/cpu.max", "r")) != NULL) {
+    if (fscanf(fp, "%31s %ld", quota, &period) == 2 &&
+        strcmp(quota, "max") != 0 && period > 0 &&
+        (n = (atol(quota) + period - 1) / period) > 0 && n < num_cpus) {
+      num_cpus = (int) n;
+    }
+    (void) fclose(fp);
+  } else {
+    // cgroup v1 keeps them apart, quota is -1 if unlimited
+    n = read_long("/sys/fs/cgroup/cpu/cpu.cfs_quota_us");
+    period = read_long("/sys/fs/cgroup/cpu/cpu.cfs_period_us");
+    if (n > 0 && period > 0 && (n + period - 1) / period < num_cpus) {
+      num_cpus = (int) ((n + period - 1) / period);
+    }
+  }
+#endif // _WIN32
+
+  return num_cpus < 1 ? 1 : num_cpus;
+}
+
+// Work out the worker pool bounds. num_threads is the number of workers
+// kept around at all times and defaults to the number of CPUs. Workers
+// mostly block on the network, so the pool may grow well beyond that.
+static void set_pool_options(struct mg_context *ctx) {
+  int num_cpus = get_num_cpus();
+
+  ctx->min_threads = ctx->config[NUM_THREADS] == NULL ?
+    num_cpus : atoi(ctx->config[NUM_THREADS]);
+  if (ctx->min_threads < 1) {
+    ctx->min_threads = 1;
+  }
+  ctx->max_threads = ctx->config[MAX_THREADS] == NULL ?
+    16 * num_cpus : atoi(ctx->config[MAX_THREADS]);
+  if (ctx->max_threads < ctx->min_threads) {
+    ctx->max_threads = ctx->min_threads;
+  }
+  if ((ctx->idle_timeout_ms = atoi(ctx->config[IDLE_THREAD_TIMEOUT])) <= 0) {
+    ctx->idle_timeout_ms = -1;  // Never shrink
+  }
+}
+
+// Worker threads take accepted socket from the queue. Return 0 if the
+// worker should exit, either because the server is stopping or because the
+// pool has been idle for long enough to shrink.
+static int consume_socket(struct mg_context *ctx, struct socket *sp) {
+  int seq;
+
+  DEBUG_TRACE(("going idle"));
+  (void) __atomic_add_fetch(&ctx->idle_workers, 1, __ATOMIC_SEQ_CST);
+  while (!sq_pop(ctx, sp)) {
+    // The queue is empty, park. We're idle at this point.
+    seq = waitq_prepare(&ctx->sq_not_empty);
+    if (ctx->stop_flag != 0) {
+      waitq_cancel(&ctx->sq_not_empty);
+      (void) __atomic_sub_fetch(&ctx->idle_workers, 1, __ATOMIC_SEQ_CST);
+      (void) leave_pool(ctx);
+      return 0;
+    } else if (sq_pop(ctx, sp)) {
+      waitq_cancel(&ctx->sq_not_empty);
+      break;
+    }
+    // Only workers above the minimum need to notice being idle
+    if (!waitq_wait(&ctx->sq_not_empty, seq,
+                    ctx->num_workers > ctx->min_threads ?
+                    ctx->idle_timeout_ms : -1)) {
+      // Timed out. Stop counting as idle before looking at the queue, so
+      // that a concurrent produce_socket() either sees us gone and starts
+      // another worker, or we see its socket.
+      (void) __atomic_sub_fetch(&ctx->idle_workers, 1, __ATOMIC_SEQ_CST);
+      if (sq_depth(ctx) == 0 && leave_pool(ctx)) {
+        DEBUG_TRACE(("idle for too long, exiting"));
+        return 0;
+      }
+      (void) __atomic_add_fetch(&ctx->idle_workers, 1, __ATOMIC_SEQ_CST);
+    }
+  }
+  (void) __atomic_sub_fetch(&ctx->idle_workers, 1, __ATOMIC_SEQ_CST);
+  DEBUG_TRACE(("grabbed socket %d, going busy", sp->sock));
+
+  // Let the master know there is room again, if it waits for it
+  waitq_wake(&ctx->sq_not_full, 1);
+
+  // More sockets are waiting than idle workers can take: grow the pool
+  grow_pool(ctx);
+
+  return 1;
 }
 
 static void worker_thread(struct mg_context *ctx) {
   struct mg_connection *conn;
-  int buf_size = atoi(ctx->config[MAX_REQUEST_SIZE]);
+  int buf_size = ctx->max_request_size;
 
   conn = (struct mg_connection *) calloc(1, sizeof(*conn) + buf_size);
   conn->buf_size = buf_size;
   conn->buf = (char *) (conn + 1);
   assert(conn != NULL);
+  conn->log_ring = add_log_ring(ctx);
+  add_thread_stats(ctx, &conn->stats);
 
-  // Call consume_socket() even when ctx->stop_flag > 0, to let it signal
-  // sq_empty condvar to wake up the master waiting in produce_socket()
   while (consume_socket(ctx, &conn->client)) {
     conn->birth_time = time(NULL);
     conn->ctx = ctx;
+    conn->stats.active = 1;
 
     // Fill in IP, port info early so even if SSL setup below fails,
     // error handler would have the corresponding info.
@@ -4026,6 +5778,11 @@ static void worker_thread(struct mg_context *ctx) {
            &conn->client.rsa.u.sin.sin_addr.s_addr, 4);
     conn->request_info.remote_ip = ntohl(conn->request_info.remote_ip);
     conn->request_info.is_ssl = conn->client.is_ssl;
+    conn->request_info.is_local = is_unix_socket(&conn->client);
+    if (conn->request_info.is_local) {
+      conn->request_info.remote_ip = 0;
+      conn->request_info.remote_port = 0;
+    }
 
     if (!conn->client.is_ssl ||
         (conn->client.is_ssl && sslize(conn, SSL_accept))) {
@@ -4033,7 +5790,15 @@ static void worker_thread(struct mg_context *ctx) {
     }
 
     close_connection(conn);
+    conn->stats.active = 0;
+  }
+#if defined(USE_IO_URING)
+  if (conn->ring != NULL) {
+    uring_free(conn->ring);
   }
+#endif // USE_IO_URING
+  retire_log_ring(ctx, conn->log_ring);
+  remove_thread_stats(ctx, &conn->stats);
   free(conn);
 
   // Signal master that we're done with connection and exiting
@@ -4048,23 +5813,27 @@ static void worker_thread(struct mg_context *ctx) {
 
 // Master thread adds accepted socket to a queue
 static void produce_socket(struct mg_context *ctx, const struct socket *sp) {
-  (void) pthread_mutex_lock(&ctx->mutex);
+  int seq;
 
   // If the queue is full, wait
-  while (ctx->stop_flag == 0 &&
-         ctx->sq_head - ctx->sq_tail >= (int) ARRAY_SIZE(ctx->queue)) {
-    (void) pthread_cond_wait(&ctx->sq_empty, &ctx->mutex);
+  while (!sq_push(ctx, sp)) {
+    seq = waitq_prepare(&ctx->sq_not_full);
+    if (ctx->stop_flag != 0) {
+      waitq_cancel(&ctx->sq_not_full);
+      (void) closesocket(sp->sock);
+      return;
+    } else if (sq_push(ctx, sp)) {
+      waitq_cancel(&ctx->sq_not_full);
+      break;
+    }
+    (void) waitq_wait(&ctx->sq_not_full, seq, -1);
   }
+  DEBUG_TRACE(("queued socket %d", sp->sock));
 
-  if (ctx->sq_head - ctx->sq_tail < (int) ARRAY_SIZE(ctx->queue)) {
-    // Copy socket to the queue and increment head
-    ctx->queue[ctx->sq_head % ARRAY_SIZE(ctx->queue)] = *sp;
-    ctx->sq_head++;
-    DEBUG_TRACE(("queued socket %d", sp->sock));
-  }
+  waitq_wake(&ctx->sq_not_empty, 1);
 
-  (void) pthread_cond_signal(&ctx->sq_full);
-  (void) pthread_mutex_unlock(&ctx->mutex);
+  // All workers are busy: grow the pool rather than let the socket wait
+  grow_pool(ctx);
 }
 
 static void accept_new_connection(const struct socket *listener,
@@ -4072,11 +5841,12 @@ static void accept_new_connection(const struct socket *listener,
   struct socket accepted;
   int allowed;
 
-  accepted.rsa.len = sizeof(accepted.rsa.u.sin);
+  accepted.rsa.len = sizeof(accepted.rsa.u);
   accepted.lsa = listener->lsa;
   accepted.sock = accept(listener->sock, &accepted.rsa.u.sa, &accepted.rsa.len);
   if (accepted.sock != INVALID_SOCKET) {
-    allowed = check_acl(ctx, &accepted.rsa);
+    // The ACL is about IP addresses, file permissions guard local sockets
+    allowed = is_unix_socket(listener) || check_acl(ctx, &accepted.rsa);
     if (allowed) {
       // Put accepted socket structure into the queue
       DEBUG_TRACE(("accepted socket %d", accepted.sock));
@@ -4130,7 +5900,7 @@ static void master_thread(struct mg_context *ctx) {
   close_all_listening_sockets(ctx);
 
   // Wakeup workers that are waiting for connections to handle.
-  pthread_cond_broadcast(&ctx->sq_full);
+  waitq_wake(&ctx->sq_not_empty, INT_MAX);
 
   // Wait until all threads finish
   (void) pthread_mutex_lock(&ctx->mutex);
@@ -4142,8 +5912,21 @@ static void master_thread(struct mg_context *ctx) {
   // All threads exited, no sync is needed. Destroy mutex and condvars
   (void) pthread_mutex_destroy(&ctx->mutex);
   (void) pthread_cond_destroy(&ctx->cond);
-  (void) pthread_cond_destroy(&ctx->sq_empty);
-  (void) pthread_cond_destroy(&ctx->sq_full);
+#if defined(USE_EPOLL)
+  (void) pthread_cond_destroy(&ctx->transfers_done);
+#endif // USE_EPOLL
+  waitq_destroy(&ctx->sq_not_empty);
+  waitq_destroy(&ctx->sq_not_full);
+  if (ctx->log_enabled) {
+    (void) pthread_mutex_destroy(&ctx->log_mutex);
+    waitq_destroy(&ctx->log_wakeup);
+  }
+
+#if defined(USE_EPOLL)
+  if (ctx->epoll_fd != -1) {
+    (void) close(ctx->epoll_fd);
+  }
+#endif // USE_EPOLL
 
 #if !defined(NO_SSL)
   uninitialize_ssl(ctx);
@@ -4164,6 +5947,15 @@ static void free_context(struct mg_context *ctx) {
       free(ctx->config[i]);
   }
 
+  if (ctx->queue != NULL) {
+    free(ctx->queue);
+  }
+
+  free(ctx->cgi_extensions);
+  free(ctx->ssi_extensions);
+  free(ctx->mime_types);
+  free(ctx->mime_suffixes);
+
   // Deallocate SSL context
   if (ctx->ssl_ctx != NULL) {
     SSL_CTX_free(ctx->ssl_ctx);
@@ -4203,11 +5995,16 @@ struct mg_context *mg_start(mg_callback_t user_callback, void *user_data,
   WSAStartup(MAKEWORD(2,2), &data);
 #endif // _WIN32
 
+  select_scanner();
+
   // Allocate context and initialize reasonable general case defaults.
   // TODO(lsm): do proper error handling here.
   ctx = (struct mg_context *) calloc(1, sizeof(*ctx));
   ctx->user_callback = user_callback;
   ctx->user_data = user_data;
+#if defined(USE_EPOLL)
+  ctx->epoll_fd = -1;
+#endif // USE_EPOLL
 
   while (options && (name = *options++) != NULL) {
     if ((i = get_option_index(name)) == -1) {
@@ -4234,9 +6031,27 @@ struct mg_context *mg_start(mg_callback_t user_callback, void *user_data,
     }
   }
 
+  if ((ctx->io_buffer_size = atoi(ctx->config[IO_BUFFER_SIZE])) < BUFSIZ) {
+    ctx->io_buffer_size = BUFSIZ;
+  }
+  ctx->max_request_size = atoi(ctx->config[MAX_REQUEST_SIZE]);
+  ctx->enable_keep_alive = !mg_strcasecmp(ctx->config[ENABLE_KEEP_ALIVE], "yes");
+  ctx->enable_directory_listing =
+    !mg_strcasecmp(ctx->config[ENABLE_DIRECTORY_LISTING], "yes");
+  set_pool_options(ctx);
+#if defined(USE_IO_URING)
+  if (!mg_strcasecmp(ctx->config[ENABLE_IO_URING], "yes")) {
+    if ((ctx->use_io_uring = uring_supported()) == 0) {
+      cry(fc(ctx), "io_uring is not available, using the regular file path");
+    }
+  }
+#endif // USE_IO_URING
+
   // NOTE(lsm): order is important here. SSL certificates must
   // be initialized before listening ports. UID must be set last.
   if (!set_gpass_option(ctx) ||
+      !set_extensions_option(ctx) ||
+      !set_mime_types_option(ctx) ||
 #if !defined(NO_SSL)
       !set_ssl_option(ctx) ||
 #endif
@@ -4244,7 +6059,8 @@ struct mg_context *mg_start(mg_callback_t user_callback, void *user_data,
 #if !defined(_WIN32)
       !set_uid_option(ctx) ||
 #endif
-      !set_acl_option(ctx)) {
+      !set_acl_option(ctx) ||
+      !init_socket_queue(ctx)) {
     free_context(ctx);
     return NULL;
   }
@@ -4259,18 +6075,64 @@ struct mg_context *mg_start(mg_callback_t user_callback, void *user_data,
 
   (void) pthread_mutex_init(&ctx->mutex, NULL);
   (void) pthread_cond_init(&ctx->cond, NULL);
-  (void) pthread_cond_init(&ctx->sq_empty, NULL);
-  (void) pthread_cond_init(&ctx->sq_full, NULL);
+#if defined(USE_EPOLL)
+  (void) pthread_cond_init(&ctx->transfers_done, NULL);
+#endif // USE_EPOLL
+
+  // Start logger thread before the workers, they check log_enabled
+  if (ctx->config[ACCESS_LOG_FILE] != NULL) {
+    ctx->log_flush_ms = atoi(ctx->config[ACCESS_LOG_FLUSH_MS]);
+    ctx->log_batch_size = atoi(ctx->config[ACCESS_LOG_BATCH_SIZE]);
+    if (ctx->log_flush_ms <= 0) {
+      ctx->log_flush_ms = 1000;
+    }
+    if (ctx->log_batch_size < BUFSIZ) {
+      ctx->log_batch_size = BUFSIZ;
+    }
+    (void) pthread_mutex_init(&ctx->log_mutex, NULL);
+    waitq_init(&ctx->log_wakeup);
+    if (start_thread(ctx, (mg_thread_func_t) logger_thread, ctx) != 0) {
+      cry(fc(ctx), "Cannot start logger thread: %d", ERRNO);
+      (void) pthread_mutex_destroy(&ctx->log_mutex);
+      waitq_destroy(&ctx->log_wakeup);
+    } else {
+      ctx->log_enabled = 1;
+      ctx->num_threads++;
+    }
+  }
+
+#if defined(USE_EPOLL)
+  // Start reactor thread that drives offloaded file sends. Before the
+  // workers, so that they never see an epoll_fd without a reactor behind it.
+  if (!mg_strcasecmp(ctx->config[ENABLE_EPOLL], "yes")) {
+    if ((ctx->epoll_fd = epoll_create(64)) == -1) {
+      cry(fc(ctx), "epoll_create: %s", strerror(ERRNO));
+    } else if (start_thread(ctx, (mg_thread_func_t) reactor_thread,
+                            ctx) != 0) {
+      cry(fc(ctx), "Cannot start reactor thread: %d", ERRNO);
+      (void) close(ctx->epoll_fd);
+      ctx->epoll_fd = -1;
+    } else {
+      set_close_on_exec(ctx->epoll_fd);
+      (void) pthread_mutex_lock(&ctx->mutex);
+      ctx->num_threads++;
+      (void) pthread_mutex_unlock(&ctx->mutex);
+    }
+  }
+#endif // USE_EPOLL
 
   // Start master (listening) thread
   start_thread(ctx, (mg_thread_func_t) master_thread, ctx);
 
-  // Start worker threads
-  for (i = 0; i < atoi(ctx->config[NUM_THREADS]); i++) {
+  // Start the minimum number of worker threads, grow_pool() adds more
+  for (i = 0; i < ctx->min_threads; i++) {
     if (start_thread(ctx, (mg_thread_func_t) worker_thread, ctx) != 0) {
       cry(fc(ctx), "Cannot start worker thread: %d", ERRNO);
     } else {
+      (void) pthread_mutex_lock(&ctx->mutex);
+      ctx->num_workers++;
       ctx->num_threads++;
+      (void) pthread_mutex_unlock(&ctx->mutex);
     }
   }
 
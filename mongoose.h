@@ -44,6 +44,7 @@ struct mg_request_info {
   int remote_port;       // Client's port
   int status_code;       // HTTP reply status code, e.g. 200
   int is_ssl;            // 1 if SSL-ed, 0 if not
+  int is_local;          // 1 if connected through a Unix-domain socket
   int num_headers;       // Number of headers
   struct mg_header {
     char *name;          // HTTP header name
@@ -127,6 +128,49 @@ void mg_stop(struct mg_context *);
 const char *mg_get_option(const struct mg_context *ctx, const char *name);
 
 
+// Worker pool statistics, see mg_get_pool_stats().
+struct mg_pool_stats {
+  int num_threads;    // Worker threads currently in the pool
+  int idle_threads;   // Of those, how many wait for a connection
+  int min_threads;    // Lower bound, the "num_threads" option
+  int max_threads;    // Upper bound, the "max_threads" option
+  int queue_depth;    // Accepted connections waiting for a worker
+  int queue_size;     // Capacity of the accepted connections queue
+  int num_transfers;  // File sends offloaded to the epoll reactor
+};
+
+
+// Get a snapshot of the worker pool state.
+// The pool starts with "num_threads" workers (default: number of CPUs,
+// respecting a cgroup CPU quota), grows up to "max_threads" when accepted
+// connections queue up, and shrinks back after "idle_thread_timeout_ms".
+// Offloaded file sends carry on after their worker is back in the pool,
+// and are aborted by mg_stop().
+// The values are read without locking and may be slightly out of sync.
+void mg_get_pool_stats(const struct mg_context *ctx,
+                       struct mg_pool_stats *stats);
+
+
+// Block until no offloaded file sends are in flight, the last one's socket
+// closed. Returns at once if there are none, or without enable_epoll.
+void mg_wait_for_transfers(struct mg_context *ctx);
+
+
+// Traffic counters, summed up over the threads that count them.
+struct mg_server_stats {
+  long long bytes_sent;     // To clients since mg_start(), live
+  long long requests;       // Requests served
+  int active_connections;   // Being served by a worker or by the reactor
+};
+
+
+// Get a snapshot of the traffic counters.
+// The worker threads count into their own cache lines, only this
+// function takes a lock to add them up.
+void mg_get_server_stats(struct mg_context *ctx,
+                         struct mg_server_stats *stats);
+
+
 // Return array of strings that represent valid configuration options.
 // For each option, a short name, long name, and default value is returned.
 // Array is NULL terminated.
@@ -164,10 +208,33 @@ int mg_printf(struct mg_connection *, const char *fmt, ...);
 
 
 // Send contents of the entire file together with HTTP headers.
+//
+// If "enable_epoll" option is set, and the connection is not kept alive,
+// the file body may be handed over to the reactor thread and sent after
+// this function returns. Nothing else may be written to the connection then.
 void mg_send_file(struct mg_connection *conn, const char *path, 
                   const char *filename);
 
 
+// Headers of a file that stay the same from one download to the next:
+// Last-Modified, Etag, Content-disposition and Content-Type.
+//
+// For a file sent many times, prepare them once with
+// mg_prepare_file_headers(), and send the file with mg_send_prepared_file(),
+// which only adds the status, Date, the length and Connection, and
+// extra_headers if not NULL, each line ending with "\r\n". If the file has
+// changed since, that response gets fresh headers and no extra ones.
+// mg_prepare_file_headers() returns NULL if path is not a file.
+struct mg_file_headers;
+struct mg_file_headers *mg_prepare_file_headers(struct mg_context *ctx,
+                                                const char *path,
+                                                const char *filename);
+void mg_send_prepared_file(struct mg_connection *conn,
+                           const struct mg_file_headers *headers,
+                           const char *extra_headers);
+void mg_free_file_headers(struct mg_file_headers *headers);
+
+
 // Read data from the remote end, return number of bytes read.
 int mg_read(struct mg_connection *, void *buf, size_t len);
 
@@ -214,6 +281,12 @@ int mg_get_cookie(const struct mg_connection *,
                   const char *cookie_name, char *buf, size_t buf_len);
 
 
+// URL-encode input buffer into destination buffer.
+// Destination buffer is guaranteed to be '\0' - terminated. Characters that
+// do not fit into the destination buffer are dropped.
+void mg_url_encode(const char *src, char *dst, size_t dst_len);
+
+
 // Return Mongoose version.
 const char *mg_version(void);
 
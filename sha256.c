@@ -0,0 +1,224 @@
+/* Copyright (c) 2012, Hui Peng Hu
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *    This product includes software developed by Hui Peng Hu.
+ *
+ *    THIS SOFTWARE IS PROVIDED BY Hui Peng Hu ''AS IS'' AND ANY
+ *    EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *    WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *    DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *    DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *    (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *    LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *    ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *    SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+
+#include "sha256.h"
+
+#if !defined(NO_SIMD) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || \
+     (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#include <immintrin.h>
+#include <cpuid.h>
+#define USE_SHA_NI
+#endif
+
+static const uint32_t k[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+  0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+  0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+  0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+  0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+  0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+  0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+  0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+  0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void compress_generic(uint32_t *state, const unsigned char *data,
+                             size_t blocks) {
+  uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+  int i;
+
+  for (; blocks > 0; blocks--, data += 64) {
+    for (i = 0; i < 16; i++) {
+      w[i] = (uint32_t) data[4 * i] << 24 | (uint32_t) data[4 * i + 1] << 16 |
+        (uint32_t) data[4 * i + 2] << 8 | data[4 * i + 3];
+    }
+    for (; i < 64; i++) {
+      w[i] = w[i - 16] + w[i - 7] +
+        (ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+        (ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10));
+    }
+
+    a = state[0]; b = state[1]; c = state[2]; d = state[3];
+    e = state[4]; f = state[5]; g = state[6]; h = state[7];
+    for (i = 0; i < 64; i++) {
+      t1 = h + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + ((e & f) ^ (~e & g)) +
+        k[i] + w[i];
+      t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) +
+        ((a & b) ^ (a & c) ^ (b & c));
+      h = g; g = f; f = e; e = d + t1;
+      d = c; c = b; b = a; a = t1 + t2;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+  }
+}
+
+#if defined(USE_SHA_NI)
+// The state is kept as ABEF and CDGH, the order sha256rnds2 wants it in.
+// Each step runs four rounds, the message schedule is computed four words
+// at a time in a ring of four vectors.
+__attribute__((target("sha,ssse3,sse4.1")))
+static void compress_sha_ni(uint32_t *state, const unsigned char *data,
+                            size_t blocks) {
+  const __m128i byteswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+                                          0x0405060700010203ULL);
+  __m128i abef, cdgh, abef_save, cdgh_save, msg, tmp, w[4];
+  int i;
+
+  tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &state[0]), 0xb1);
+  cdgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &state[4]), 0x1b);
+  abef = _mm_alignr_epi8(tmp, cdgh, 8);
+  cdgh = _mm_blend_epi16(cdgh, tmp, 0xf0);
+
+  for (; blocks > 0; blocks--, data += 64) {
+    abef_save = abef;
+    cdgh_save = cdgh;
+
+    for (i = 0; i < 16; i++) {
+      if (i < 4) {
+        w[i] = _mm_shuffle_epi8(
+            _mm_loadu_si128((const __m128i *) (data + 16 * i)), byteswap);
+      } else {
+        tmp = _mm_add_epi32(_mm_sha256msg1_epu32(w[i & 3], w[(i + 1) & 3]),
+                            _mm_alignr_epi8(w[(i + 3) & 3], w[(i + 2) & 3], 4));
+        w[i & 3] = _mm_sha256msg2_epu32(tmp, w[(i + 3) & 3]);
+      }
+      msg = _mm_add_epi32(w[i & 3],
+                          _mm_loadu_si128((const __m128i *) &k[4 * i]));
+      cdgh = _mm_sha256rnds2_epu32(cdgh, abef, msg);
+      abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(msg, 0x0e));
+    }
+
+    abef = _mm_add_epi32(abef, abef_save);
+    cdgh = _mm_add_epi32(cdgh, cdgh_save);
+  }
+
+  tmp = _mm_shuffle_epi32(abef, 0x1b);
+  cdgh = _mm_shuffle_epi32(cdgh, 0xb1);
+  _mm_storeu_si128((__m128i *) &state[0], _mm_blend_epi16(tmp, cdgh, 0xf0));
+  _mm_storeu_si128((__m128i *) &state[4], _mm_alignr_epi8(cdgh, tmp, 8));
+}
+
+static int has_sha_ni(void) {
+  unsigned int eax, ebx, ecx, edx;
+
+  if (__get_cpuid_max(0, NULL) < 7) {
+    return 0;
+  }
+  __cpuid(1, eax, ebx, ecx, edx);
+  if (!(ecx & bit_SSSE3) || !(ecx & bit_SSE4_1)) {
+    return 0;
+  }
+  __cpuid_count(7, 0, eax, ebx, ecx, edx);
+  return (ebx >> 29) & 1;
+}
+#endif // USE_SHA_NI
+
+void sha256_init(struct sha256 *ctx) {
+  static const uint32_t initial[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+
+  memcpy(ctx->state, initial, sizeof(ctx->state));
+  ctx->length = 0;
+  ctx->compress = compress_generic;
+#if defined(USE_SHA_NI)
+  if (has_sha_ni()) {
+    ctx->compress = compress_sha_ni;
+  }
+#endif // USE_SHA_NI
+}
+
+void sha256_update(struct sha256 *ctx, const void *data, size_t len) {
+  const unsigned char *p = (const unsigned char *) data;
+  size_t used = (size_t) (ctx->length % 64), n;
+
+  ctx->length += len;
+
+  // Top up a partial block first
+  if (used > 0) {
+    n = 64 - used < len ? 64 - used : len;
+    memcpy(ctx->block + used, p, n);
+    p += n;
+    len -= n;
+    if (used + n < 64) {
+      return;
+    }
+    ctx->compress(ctx->state, ctx->block, 1);
+  }
+
+  // Whole blocks straight from the input
+  if (len >= 64) {
+    ctx->compress(ctx->state, p, len / 64);
+    p += len & ~(size_t) 63;
+    len &= 63;
+  }
+  memcpy(ctx->block, p, len);
+}
+
+void sha256_final(struct sha256 *ctx, unsigned char digest[SHA256_DIGEST_SIZE]) {
+  size_t used = (size_t) (ctx->length % 64);
+  uint64_t bits = ctx->length * 8;
+  int i;
+
+  // 0x80, zeros, and the length in bits, in one or two blocks
+  ctx->block[used++] = 0x80;
+  if (used > 56) {
+    memset(ctx->block + used, 0, 64 - used);
+    ctx->compress(ctx->state, ctx->block, 1);
+    used = 0;
+  }
+  memset(ctx->block + used, 0, 56 - used);
+  for (i = 0; i < 8; i++) {
+    ctx->block[56 + i] = (unsigned char) (bits >> (56 - 8 * i));
+  }
+  ctx->compress(ctx->state, ctx->block, 1);
+
+  for (i = 0; i < 8; i++) {
+    digest[4 * i] = (unsigned char) (ctx->state[i] >> 24);
+    digest[4 * i + 1] = (unsigned char) (ctx->state[i] >> 16);
+    digest[4 * i + 2] = (unsigned char) (ctx->state[i] >> 8);
+    digest[4 * i + 3] = (unsigned char) ctx->state[i];
+  }
+}
+
+const char *sha256_implementation(void) {
+#if defined(USE_SHA_NI)
+  if (has_sha_ni()) {
+    return "sha-ni";
+  }
+#endif // USE_SHA_NI
+  return "generic";
+}
@@ -0,0 +1,63 @@
+/* Copyright (c) 2012, Hui Peng Hu
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *    This product includes software developed by Hui Peng Hu.
+ *
+ *    THIS SOFTWARE IS PROVIDED BY Hui Peng Hu ''AS IS'' AND ANY
+ *    EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *    WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *    DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *    DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *    (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *    LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *    ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *    SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// SHA-256 (FIPS 180-4), with the x86 SHA extensions when the CPU has them
+
+#ifndef SHA256_HEADER_INCLUDED
+#define SHA256_HEADER_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+#define SHA256_DIGEST_SIZE 32
+
+struct sha256 {
+  uint32_t state[8];
+  uint64_t length;            // Bytes hashed so far
+  unsigned char block[64];    // Input not hashed yet, length % 64 bytes
+  void (*compress)(uint32_t *state, const unsigned char *data, size_t blocks);
+};
+
+// Start a new digest. Picks the fastest implementation the CPU supports.
+void sha256_init(struct sha256 *ctx);
+
+void sha256_update(struct sha256 *ctx, const void *data, size_t len);
+
+// Finish the digest and store it in digest.
+void sha256_final(struct sha256 *ctx, unsigned char digest[SHA256_DIGEST_SIZE]);
+
+// "sha-ni" or "generic", what sha256_init() picks on this CPU.
+const char *sha256_implementation(void);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
+#endif // SHA256_HEADER_INCLUDED